@@ -0,0 +1,162 @@
+#include "budget.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+
+/*
+ * Budget - a thread safe ceiling on the bytes held in memory at once.
+ * Waiters take a ticket and are admitted in ticket order, so a large
+ * request is not starved by a stream of small ones.
+ */
+typedef struct BudgetStruct {
+    long limit;
+    long used;
+    long peak;
+    unsigned long next_ticket;  //Ticket of the next thread to wait
+    unsigned long serving;      //Ticket of the thread admitted next
+    pthread_mutex_t mutex;      //pretect the counters
+    pthread_cond_t changed;     //Signalled when bytes are released
+} Budget;
+
+
+/**
+ * Allocate a budget of a given number of bytes
+ * @param limit - The most bytes held at once, 0 for no limit
+ * @return budget - Pointer to the allocated budget
+ */
+Budget *budget_alloc(long limit) {
+    Budget *budget = (Budget*)malloc(sizeof(Budget));
+    budget->limit = limit;
+    budget->used = 0;
+    budget->peak = 0;
+    budget->next_ticket = 0;
+    budget->serving = 0;
+    pthread_mutex_init(&budget->mutex, NULL);
+    pthread_cond_init(&budget->changed, NULL);
+
+    return budget;
+}
+
+
+/**
+ * Free a budget
+ *
+ * Don't call this function while threads are still waiting on it.
+ *
+ * @param budget - Pointer to the budget to free
+ */
+void budget_free(Budget *budget) {
+    pthread_mutex_destroy(&budget->mutex);
+    pthread_cond_destroy(&budget->changed);
+    free(budget);
+}
+
+
+/**
+ * Add to the bytes held, keeping the peak. The caller holds the mutex.
+ */
+static void add_used(Budget *budget, long bytes) {
+    budget->used += bytes;
+    if (budget->used > budget->peak) {
+        budget->peak = budget->used;
+    }
+}
+
+
+/**
+ * Take bytes from the budget, blocking until they fit. Waiters are
+ * admitted oldest first, and a request larger than the whole budget is
+ * admitted once nothing else is held so it cannot wait forever.
+ * @param budget - Pointer to the budget
+ * @param bytes - The number of bytes
+ */
+void budget_acquire(Budget *budget, long bytes) {
+    pthread_mutex_lock(&budget->mutex);
+
+    unsigned long ticket = budget->next_ticket++;
+    while (ticket != budget->serving || (budget->limit > 0 && budget->used > 0
+        && budget->used + bytes > budget->limit)) {
+        pthread_cond_wait(&budget->changed, &budget->mutex);
+    }
+
+    add_used(budget, bytes);
+    ++budget->serving;
+
+    //The next ticket may fit as well
+    pthread_cond_broadcast(&budget->changed);
+    pthread_mutex_unlock(&budget->mutex);
+}
+
+
+/**
+ * Take bytes from the budget only if they fit now and no one is waiting
+ * ahead, so a caller can grow what it holds without jumping the queue
+ * @param budget - Pointer to the budget
+ * @param bytes - The number of bytes
+ * @return int - 0 if the bytes were taken, -1 otherwise
+ */
+int budget_try_acquire(Budget *budget, long bytes) {
+    int rc = -1;
+
+    pthread_mutex_lock(&budget->mutex);
+    if (budget->next_ticket == budget->serving && (budget->limit <= 0
+        || budget->used == 0 || budget->used + bytes <= budget->limit)) {
+        add_used(budget, bytes);
+        rc = 0;
+    }
+    pthread_mutex_unlock(&budget->mutex);
+
+    return rc;
+}
+
+
+/**
+ * Correct a holding by bytes without waiting, e.g. once the real size
+ * of something acquired on an estimate is known. Negative bytes release.
+ * @param budget - Pointer to the budget
+ * @param bytes - The number of bytes to add
+ */
+void budget_charge(Budget *budget, long bytes) {
+    pthread_mutex_lock(&budget->mutex);
+    add_used(budget, bytes);
+    if (bytes < 0) {
+        pthread_cond_broadcast(&budget->changed);
+    }
+    pthread_mutex_unlock(&budget->mutex);
+}
+
+
+/**
+ * Give bytes back to the budget, waking waiters they make room for
+ * @param budget - Pointer to the budget
+ * @param bytes - The number of bytes
+ */
+void budget_release(Budget *budget, long bytes) {
+    budget_charge(budget, -bytes);
+}
+
+
+/**
+ * The ceiling of a budget
+ * @param budget - Pointer to the budget
+ * @return long - The most bytes held at once, 0 for no limit
+ */
+long budget_limit(Budget *budget) {
+    return budget->limit;
+}
+
+
+/**
+ * The most bytes held at once so far
+ * @param budget - Pointer to the budget
+ * @return long - The peak in bytes
+ */
+long budget_peak(Budget *budget) {
+    pthread_mutex_lock(&budget->mutex);
+    long peak = budget->peak;
+    pthread_mutex_unlock(&budget->mutex);
+
+    return peak;
+}
@@ -0,0 +1,85 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+
+/*
+ * Budget - a thread safe ceiling on the bytes held in memory at once.
+ * Threads acquire bytes before buffering them and release them once the
+ * bytes are freed, waiting in turn while the budget is exhausted.
+ * The implementation is hidden from the outside.
+ */
+typedef struct BudgetStruct Budget;
+
+
+/**
+ * Allocate a budget of a given number of bytes
+ * @param limit - The most bytes held at once, 0 for no limit
+ * @return budget - Pointer to the allocated budget
+ */
+Budget *budget_alloc(long limit);
+
+
+/**
+ * Free a budget
+ *
+ * Don't call this function while threads are still waiting on it.
+ *
+ * @param budget - Pointer to the budget to free
+ */
+void budget_free(Budget *budget);
+
+
+/**
+ * Take bytes from the budget, blocking until they fit. Waiters are
+ * admitted oldest first, and a request larger than the whole budget is
+ * admitted once nothing else is held so it cannot wait forever.
+ * @param budget - Pointer to the budget
+ * @param bytes - The number of bytes
+ */
+void budget_acquire(Budget *budget, long bytes);
+
+
+/**
+ * Take bytes from the budget only if they fit now and no one is waiting
+ * ahead, so a caller can grow what it holds without jumping the queue
+ * @param budget - Pointer to the budget
+ * @param bytes - The number of bytes
+ * @return int - 0 if the bytes were taken, -1 otherwise
+ */
+int budget_try_acquire(Budget *budget, long bytes);
+
+
+/**
+ * Correct a holding by bytes without waiting, e.g. once the real size
+ * of something acquired on an estimate is known. Negative bytes release.
+ * @param budget - Pointer to the budget
+ * @param bytes - The number of bytes to add
+ */
+void budget_charge(Budget *budget, long bytes);
+
+
+/**
+ * Give bytes back to the budget, waking waiters they make room for
+ * @param budget - Pointer to the budget
+ * @param bytes - The number of bytes
+ */
+void budget_release(Budget *budget, long bytes);
+
+
+/**
+ * The ceiling of a budget
+ * @param budget - Pointer to the budget
+ * @return long - The most bytes held at once, 0 for no limit
+ */
+long budget_limit(Budget *budget);
+
+
+/**
+ * The most bytes held at once so far
+ * @param budget - Pointer to the budget
+ * @return long - The peak in bytes
+ */
+long budget_peak(Budget *budget);
+
+
+#endif
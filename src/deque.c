@@ -0,0 +1,128 @@
+#include "deque.h"
+
+#include <stdlib.h>
+
+
+/*
+ * Deque - a Chase-Lev work-stealing deque over a ring of items. Items
+ * between top and bottom are held; the owner moves bottom, thieves move
+ * top with a compare and swap, and the two race only for the last item.
+ */
+typedef struct DequeStruct {
+    long top;           //Next item to steal, only ever increases
+    long bottom;        //Next place to push, owner only
+    long mask;          //Capacity - 1, the capacity is a power of 2
+    void **items;
+} Deque;
+
+
+/**
+ * Allocate a deque
+ * @param size - The most items held at once, rounded up to a power of 2
+ * @return deque - Pointer to the allocated deque
+ */
+Deque *deque_alloc(int size) {
+    Deque *deque = (Deque*)malloc(sizeof(Deque));
+    long capacity = 1;
+
+    while (capacity < size) {
+        capacity <<= 1;
+    }
+    deque->top = 0;
+    deque->bottom = 0;
+    deque->mask = capacity - 1;
+    deque->items = (void**)calloc(capacity, sizeof(void*));
+
+    return deque;
+}
+
+
+/**
+ * Free a deque
+ *
+ * Don't call this function while the deque is still in use.
+ *
+ * @param deque - Pointer to the deque to free
+ */
+void deque_free(Deque *deque) {
+    free(deque->items);
+    free(deque);
+}
+
+
+/**
+ * Push an item at the bottom. Owner only.
+ * @param deque - Pointer to the deque
+ * @param item - The item, not NULL
+ * @return int - 0 on success, -1 if the deque is full
+ */
+int deque_push(Deque *deque, void *item) {
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+
+    if (bottom - top > deque->mask) {
+        return -1;
+    }
+
+    //Publish the item before the bottom which makes it visible to thieves
+    __atomic_store_n(&deque->items[bottom & deque->mask], item, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+/**
+ * Pop the item at the bottom, the newest. Owner only.
+ * @param deque - Pointer to the deque
+ * @return item - The item, NULL if the deque is empty
+ */
+void *deque_pop(Deque *deque) {
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+
+    //Claim the bottom item before looking at top, so a thief sees the claim
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    if (top > bottom) {
+        //Empty, undo the claim
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    void *item = __atomic_load_n(&deque->items[bottom & deque->mask], __ATOMIC_RELAXED);
+    if (top == bottom) {
+        //The last item, race the thieves for it
+        if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            item = NULL;
+        }
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return item;
+}
+
+
+/**
+ * Steal the item at the top, the oldest. Any thread.
+ * @param deque - Pointer to the deque
+ * @return item - The item, NULL if the deque is empty or another thread
+ *                took the item first
+ */
+void *deque_steal(Deque *deque, int *lost) {
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+    if (top >= bottom) {
+        return NULL;
+    }
+
+    void *item = __atomic_load_n(&deque->items[top & deque->mask], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        *lost = 1;
+        return NULL;
+    }
+    return item;
+}
@@ -0,0 +1,59 @@
+#ifndef DEQUE_H
+#define DEQUE_H
+
+
+/*
+ * Deque - a Chase-Lev work-stealing deque of a fixed capacity. Only its
+ * owner pushes and pops, at the bottom; any other thread may steal from
+ * the top. None of the calls lock or block.
+ * The implementation is hidden from the outside.
+ */
+typedef struct DequeStruct Deque;
+
+
+/**
+ * Allocate a deque
+ * @param size - The most items held at once, rounded up to a power of 2
+ * @return deque - Pointer to the allocated deque
+ */
+Deque *deque_alloc(int size);
+
+
+/**
+ * Free a deque
+ *
+ * Don't call this function while the deque is still in use.
+ *
+ * @param deque - Pointer to the deque to free
+ */
+void deque_free(Deque *deque);
+
+
+/**
+ * Push an item at the bottom. Owner only.
+ * @param deque - Pointer to the deque
+ * @param item - The item, not NULL
+ * @return int - 0 on success, -1 if the deque is full
+ */
+int deque_push(Deque *deque, void *item);
+
+
+/**
+ * Pop the item at the bottom, the newest. Owner only.
+ * @param deque - Pointer to the deque
+ * @return item - The item, NULL if the deque is empty
+ */
+void *deque_pop(Deque *deque);
+
+
+/**
+ * Steal the item at the top, the oldest. Any thread.
+ * @param deque - Pointer to the deque
+ * @param lost - Set to 1 if another thread took the item first, so the
+ *               deque may still hold items; left alone otherwise
+ * @return item - The item, NULL if the deque is empty or the item was lost
+ */
+void *deque_steal(Deque *deque, int *lost);
+
+
+#endif
@@ -1,32 +1,132 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <errno.h>
+#include <stdint.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <poll.h>
 
 #include "http.h"
 #include "queue.h"
+#include "uring.h"
+#include "sink.h"
+#include "pool.h"
+#include "budget.h"
+#include "slice.h"
+#include "deque.h"
+#include "ring.h"
+#include "typed_queue.h"
 
 #define FILE_SIZE 256
-
-typedef struct {
+#define WHOLE_FILE -1   //max_range of a task fetching a whole file
+#define OPEN_ENDED -2   //max_range of a task fetching from min_range onwards
+#define OPEN_CHUNK_SIZE (1 << 20)   //Default chunk size when the length is unknown
+#define SEGMENT_SIZE (1 << 20)      //Size of the pooled receive buffers for sinks
+#define RESULT_SEGMENT (4 << 20)    //Least size of the pooled buffers results are received into
+#define HEADER_ROOM 4096            //Room left in a result segment for request and header
+#define WRITE_BATCH (4 << 20)       //Adjacent bytes a writer gathers before one pwritev
+#define WRITE_IOVECS 256            //Most tasks written by one pwritev
+#define DEQUE_SIZE 1024             //Most tasks a worker holds for others to steal
+#define WAIT_BATCH 64                //Most done tasks taken off the queue at once
+#define PROGRESS_INTERVAL 1000      //Milliseconds without a done task before reporting progress
+#define MERGE_BACKLOG 2             //Urls waiting to be merged before downloads block
+
+long file_syscalls;     //Approximate system calls spent on chunk and merge files
+long bytes_downloaded;  //Body bytes written by either engine
+
+//Count file system calls, made by the main, writer and merge threads
+#define count_file_syscalls(n) __atomic_add_fetch(&file_syscalls, (n), __ATOMIC_RELAXED)
+
+
+// The final file which the writer stage writes chunks into at their offsets
+typedef struct WriteFile {
+    int fd;
+    int outstanding;        //Tasks issued for the file which no writer has yet
+} WriteFile;
+
+
+typedef struct Task {
     char *url;
-    int min_range;
-    int max_range;
-    Buffer *result;
+    long min_range;
+    long max_range;
+    Slice body;             //Body of the response, sharing the received bytes
+
+    struct Task **batch;    //Tasks fetched together over one connection
+    int batch_size;
+    int multi_range;        //Fetch the batch as one multi-range request
+
+    long limit;             //Most body bytes to keep, 0 for no limit
+    int canceled;           //Range turned out to be past the end of the file
+
+    char *dest;             //Receive the body straight into here instead of body
+    Sink *sink;             //Or stream it through pooled buffers into this sink
+    WriteFile *file;        //Or have a writer write the body into this file
+    long received;          //Body bytes received into dest or sink, -1 on failure
+    long reserved;          //Bytes of the memory budget held for body
+
+    struct Task *next;      //Next task staged for the writers
 }  Task;
 
 
+// A range handed to the workers by value, the worker making its Task
 typedef struct {
-    Queue *todo;
-    Queue *done;
+    char *url;              //The url being downloaded, valid until its chunks are collected
+    long min_range;
+    long max_range;
+    long limit;
+} Chunk;
+
+DEFINE_QUEUE(ChunkQueue, Chunk)
+
+
+typedef struct {
+    Spmc **inboxes;         //Tasks handed to each worker by the main thread
+    int inbox_size;         //Tasks an inbox holds at least
+    Deque **deques;         //Tasks each worker holds, open to stealing
+    ChunkQueue *chunks;     //Ranges any worker may take, the main thread allocating nothing
+    pthread_mutex_t work_lock;  //Protects idle and wakes idle workers
+    pthread_cond_t work_ready;
+    long work_seq;          //Bumped whenever tasks reach an inbox, deque or the chunks
+    int idle;               //Workers asleep waiting for work_seq to move
+    int next_worker;        //Worker the main thread hands the next task to
+    int started;            //Workers started so far, giving each its index
+    int batches_taken;      //Batches workers have started on, for the main thread to pace by
+    Mpsc *done;             //Finished tasks from the workers and writers for the main thread
+    int failures;           //Tasks which came back without their bytes, main thread only
+    int job;                //Index of the url being downloaded, main thread only
 
     pthread_t *threads;
     int num_workers;
+    int pipeline_depth;     //Requests in flight per connection, 0 = no pipelining
+
+    pthread_mutex_t lock;   //Protects known_size
+    long known_size;        //Learned size of an unknown-length file, -1 if not yet
+
+    Pool *segments;         //Aligned receive buffers for tasks writing to a sink
+    Pool *results;          //Huge page backed buffers small enough responses go into
+
+    Queue *writes;          //Completed tasks for the writers, NULL without writers
+    pthread_t *writers;
+    int num_writers;
+    WriteFile *output;      //File the writers write the current url into, or NULL
+    pthread_mutex_t staged_lock;
+    Task *staged;           //Tasks waiting for adjacent ones, sorted by offset
+
+    Budget *budget;         //Ceiling on the body bytes held across all tasks
+
+    char *assembly;         //Buffer a small url is put together in, or NULL
+    long assembly_size;
+
+    int queue_stats;        //Count what the queues do, printed by free_workers
 
 } Context;
 
@@ -43,20 +143,815 @@ void create_directory(const char *dir) {
 }
 
 
+Task *new_task(char *url, long min_range, long max_range) {
+    Task *task = malloc(sizeof(Task));
+    task->body = (Slice){ NULL, NULL, 0 };
+    task->url = malloc(strlen(url) + 1);
+    task->min_range = min_range;
+    task->max_range = max_range;
+    task->batch = NULL;
+    task->batch_size = 0;
+    task->multi_range = 0;
+    task->limit = 0;
+    task->canceled = 0;
+    task->dest = NULL;
+    task->sink = NULL;
+    task->file = NULL;
+    task->received = 0;
+    task->reserved = 0;
+    task->next = NULL;
+
+    strcpy(task->url, url);
+
+    return task;
+}
+
+void free_task(Task *task) {
+
+    slice_release(&task->body);
+
+    free(task->batch);
+    free(task->url);
+    free(task);
+}
+
+/**
+ * Create a task which fetches its sub-tasks together over one connection
+ * @param url - The url of the first sub-task, used for the host
+ * @param size - The number of sub-tasks to hold
+ * @return Task - The batch, with room for size sub-tasks
+ */
+Task *new_batch(char *url, int size) {
+    Task *batch = new_task(url, 0, 0);
+    batch->batch = malloc(sizeof(Task*) * size);
+    batch->batch_size = size;
+
+    return batch;
+}
+
+
+/**
+ * Write the Range value a task asks for, e.g. 0-499, 500- or nothing.
+ * A chunk spanning the whole file asks for no range, so a server which
+ * ignores ranges answers it with the 200 that is then expected.
+ * @param task - The task to describe
+ * @param range - Receives the range
+ * @param size - The size of range in bytes
+ */
+void format_range(Task *task, char *range, size_t size) {
+    if (task->max_range == WHOLE_FILE
+        || (task->min_range == 0 && task->max_range >= 0 && task->max_range + 1 == get_content_size())) {
+        range[0] = '\0';
+    }
+    else if (task->max_range == OPEN_ENDED) {
+        snprintf(range, size, "%ld-", task->min_range);
+    }
+    else {
+        snprintf(range, size, "%ld-%ld", task->min_range, task->max_range);
+    }
+}
+
+
+/**
+ * Record a candidate size for the unknown-length file being downloaded.
+ * The smallest candidate wins, since a range past the end only bounds it.
+ * @param context - The worker context
+ * @param size - The candidate size, -1 to forget what was learned
+ */
+void set_known_size(Context *context, long size) {
+    pthread_mutex_lock(&context->lock);
+    if (size < 0 || context->known_size < 0 || size < context->known_size) {
+        context->known_size = size;
+    }
+    pthread_mutex_unlock(&context->lock);
+}
+
+
+long get_known_size(Context *context) {
+    pthread_mutex_lock(&context->lock);
+    long size = context->known_size;
+    pthread_mutex_unlock(&context->lock);
+
+    return size;
+}
+
+
+/**
+ * Segment release function for a response Buffer from http.c
+ * @param arg - The Buffer
+ * @param memory - Its data
+ */
+void release_buffer(void *arg, char *memory) {
+    buffer_free((Buffer*)arg);
+}
+
+
+/**
+ * Segment release function for memory from malloc
+ * @param arg - Unused
+ * @param memory - The memory to free
+ */
+void release_memory(void *arg, char *memory) {
+    free(memory);
+}
+
+
+/**
+ * Segment release function for memory checked out of a Pool
+ * @param arg - The Pool
+ * @param memory - The pooled segment
+ */
+void release_to_pool(void *arg, char *memory) {
+    pool_put((Pool*)arg, memory);
+}
+
+
+/**
+ * Take the body of a response as a task's slice. The response is
+ * wrapped into a segment which the slice then keeps alive.
+ * @param task - The task
+ * @param response - The response, whose memory the segment takes over
+ * @param release - Disposes of the response's memory
+ * @param arg - Passed to release
+ */
+void take_body(Task *task, Buffer *response, segment_release_fn release, void *arg) {
+    char *content = http_get_content(response);
+    Segment *segment = segment_new(response->data, release, arg);
+
+    task->body = segment_slice(segment, content, response->length - (content - response->data));
+    segment_release(segment);
+}
+
+
+/**
+ * Learn the file size from the response to an open-ended range, from its
+ * Content-Range or Content-Length, a short body (EOF came first) or a 416
+ * for a range past the end. A range past the end is canceled, whatever
+ * the server answered it with. Only a 206 holds the range asked
+ * for; a 200 holds the file from its start, so it can stand in for the
+ * first chunk alone and any other status fails the task.
+ * @param context - The worker context
+ * @param task - The finished open-ended task
+ * @param response - Its response, NULL if it failed
+ */
+void learn_size(Context *context, Task *task, Buffer *response) {
+    if (response == NULL) {
+        return;
+    }
+
+    int status = http_get_status(response);
+    long size = http_get_resource_size(response);
+    size_t length = task->body.length;
+    long known = size >= 0 ? size : get_known_size(context);
+
+    //An over-issued range past the end holds nothing, whatever the answer
+    if (task->min_range > 0 && known >= 0 && task->min_range >= known) {
+        set_known_size(context, known);
+        slice_release(&task->body);
+        task->canceled = 1;
+        return;
+    }
+
+    if (status != 206 && status != 416 && !(status == 200 && task->min_range == 0)) {
+        slice_release(&task->body);
+        return;
+    }
+
+    //Nothing at this offset: the range lies past the end
+    if (status == 416 || (length == 0 && task->min_range > 0)) {
+        set_known_size(context, size >= 0 ? size : task->min_range);
+        slice_release(&task->body);
+        task->canceled = 1;
+        return;
+    }
+
+    if (size < 0 && (task->limit == 0 || length < task->limit)) {
+        size = task->min_range + length;
+    }
+    if (size >= 0) {
+        set_known_size(context, size);
+    }
+}
+
+
+/**
+ * The most body bytes a task can hold: its limit or range when known,
+ * else a guess corrected by settle_task once the body is in
+ * @param task - The task, or a batch of them
+ * @return long - The bytes to reserve from the memory budget
+ */
+long task_need(Task *task) {
+    long need = 0;
+
+    if (task->batch) {
+        for (int i = 0; i < task->batch_size; ++i) {
+            need += task_need(task->batch[i]);
+        }
+    }
+    else if (task->dest || task->sink) {
+        //Received into the file, nothing is buffered
+    }
+    else if (task->limit > 0) {
+        need = task->limit;
+    }
+    else if (task->max_range >= 0) {
+        need = task->max_range - task->min_range + 1;
+    }
+    else {
+        need = BUFSIZ;
+    }
+    return need;
+}
+
+
+/**
+ * Wait for a task's share of the memory budget before fetching it, so no
+ * new transfer starts while the budget is exhausted. A batch's share is
+ * split among its tasks, which are released one by one.
+ * @param context - The worker context
+ * @param task - The task, or a batch of them
+ */
+void reserve_task(Context *context, Task *task) {
+    long need = task_need(task);
+
+    if (need > 0) {
+        budget_acquire(context->budget, need);
+    }
+
+    if (task->batch) {
+        for (int i = 0; i < task->batch_size; ++i) {
+            task->batch[i]->reserved = task_need(task->batch[i]);
+        }
+    }
+    else {
+        task->reserved = task_need(task);
+    }
+}
+
+
+/**
+ * Take a task's share of the memory budget only if it fits right away
+ * @param context - The worker context
+ * @param task - The task, not a batch
+ * @return int - 0 if reserved, -1 if the task has to wait its turn
+ */
+int try_reserve_task(Context *context, Task *task) {
+    long need = task_need(task);
+
+    if (need > 0 && budget_try_acquire(context->budget, need) != 0) {
+        return -1;
+    }
+    task->reserved = need;
+    return 0;
+}
+
+
+/**
+ * Correct a task's reservation to the size of the body it received
+ * @param context - The worker context
+ * @param task - The fetched task
+ */
+void settle_task(Context *context, Task *task) {
+    long held = task->body.length;
+
+    budget_charge(context->budget, held - task->reserved);
+    task->reserved = held;
+}
+
+
+/**
+ * Drop a task's body and give its bytes back to the memory budget
+ * @param context - The worker context
+ * @param task - The task
+ */
+void release_task(Context *context, Task *task) {
+    slice_release(&task->body);
+    budget_release(context->budget, task->reserved);
+    task->reserved = 0;
+}
+
+
+/**
+ * Fail a task which came back with fewer bytes than its range holds, e.g.
+ * on an early EOF, so a transfer cut short never leaves a hole in the
+ * file. Open-ended and whole-file tasks have no set length to check.
+ * @param task - The finished task
+ */
+void check_length(Task *task) {
+    long expected = task->limit > 0 ? task->limit : task->max_range - task->min_range + 1;
+
+    if (task->canceled || task->max_range < 0) {
+        return;
+    }
+    if (task->dest || task->sink) {
+        if (task->received != expected) {
+            task->received = -1;
+        }
+    }
+    else if (task->body.segment && (long)task->body.length < expected) {
+        slice_release(&task->body);
+    }
+}
+
+
+/**
+ * Hand a task a worker is finished with on: to the writers when they
+ * write the current url into its final file, otherwise to the done queue
+ * @param context - The worker context
+ * @param task - The finished task
+ */
+void complete_task(Context *context, Task *task) {
+    check_length(task);
+    settle_task(context, task);
+
+    if (context->output && !task->dest && !task->sink) {
+        task->file = context->output;
+        queue_put(context->writes, task);
+    }
+    else {
+        mpsc_put(context->done, task);
+    }
+}
+
+
+/**
+ * Fetch the tasks of a batch pipelined over a connection, then hand each
+ * of them to the done queue on its own. Each task reserves its own share
+ * of the memory budget: a run starts once its first task fits and takes
+ * as many of the next ones as fit without waiting, so a batch larger than
+ * the budget goes over several connections instead of past the limit.
+ * A response without the status its range expects fails its task like a
+ * missing one. The batch itself is freed.
+ * @param context - The worker context
+ * @param batch - Task holding the tasks to fetch together
+ */
+void run_batch(Context *context, Task *batch) {
+    int count = batch->batch_size;
+
+    __atomic_add_fetch(&context->batches_taken, 1, __ATOMIC_RELEASE);
+    char **urls = malloc(sizeof(char*) * count);
+    char **ranges = malloc(sizeof(char*) * count);
+    Buffer **results = malloc(sizeof(Buffer*) * count);
+
+    for (int i = 0; i < count; ++i) {
+        Task *task = batch->batch[i];
+        urls[i] = task->url;
+        ranges[i] = malloc(1024 * sizeof(char));
+        format_range(task, ranges[i], 1024 * sizeof(char));
+    }
+
+    for (int first = 0, last; first < count; first = last) {
+        //Step1: wait for the first task's share, then take what else fits
+        reserve_task(context, batch->batch[first]);
+        last = first + 1;
+        while (last < count && try_reserve_task(context, batch->batch[last]) == 0) {
+            ++last;
+        }
+
+        //Step2: fetch the run over one connection and hand its tasks back
+        http_pipeline_url(urls + first, ranges + first, last - first, context->pipeline_depth, results + first);
+
+        for (int i = first; i < last; ++i) {
+            if (results[i] && !http_status_matches(http_get_status(results[i]), ranges[i])) {
+                buffer_free(results[i]);
+                results[i] = NULL;
+            }
+            if (results[i]) {
+                take_body(batch->batch[i], results[i], release_buffer, results[i]);
+            }
+            complete_task(context, batch->batch[i]);
+            free(ranges[i]);
+        }
+    }
+
+    free(urls);
+    free(ranges);
+    free(results);
+    free_task(batch);
+}
+
+
+// The bodies of a multi-range batch, filled as the parts stream in
+typedef struct {
+    Task **tasks;
+    char **bodies;
+    size_t *capacities;
+    size_t *filled;     //Bytes in place from the start of each range
+    int count;
+} Placement;
+
+/**
+ * Part sink copying received bytes into the body of every task of a
+ * batch whose range holds them. Neighbouring ranges overlap by a byte,
+ * so a byte may land in two bodies. A body without a known end grows.
+ * @param arg - The Placement
+ */
+static int place_part(void *arg, long offset, const char *data, size_t length) {
+    Placement *placement = (Placement*)arg;
+    long end = offset + (long)length;
+
+    for (int i = 0; i < placement->count; ++i) {
+        Task *task = placement->tasks[i];
+        long first = offset > task->min_range ? offset : task->min_range;
+        long last = task->max_range >= 0 && task->max_range + 1 < end ? task->max_range + 1 : end;
+        if (first >= last) {
+            continue;
+        }
+
+        size_t need = last - task->min_range;
+        if (need > placement->capacities[i]) {
+            placement->capacities[i] = need * 2;
+            placement->bodies[i] = realloc(placement->bodies[i], placement->capacities[i]);
+        }
+        memcpy(placement->bodies[i] + (first - task->min_range), data + (first - offset), last - first);
+
+        //Only bytes joining those already in place count towards the body
+        if ((size_t)(first - task->min_range) <= placement->filled[i] && need > placement->filled[i]) {
+            placement->filled[i] = need;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Fetch all tasks of a batch with one request asking for each of their
+ * ranges. The multipart/byteranges response is parsed as it arrives and
+ * each part is copied straight into the bodies of the tasks whose range
+ * it holds, so the response is never buffered whole. The batch itself
+ * is freed.
+ * @param context - The worker context
+ * @param batch - Task holding the tasks to fetch together
+ */
+void run_multi_range(Context *context, Task *batch) {
+    int count = batch->batch_size;
+    char *ranges = malloc(count * 48 + 1);
+    Placement placement = {
+        batch->batch,
+        calloc(count, sizeof(char*)),
+        calloc(count, sizeof(size_t)),
+        calloc(count, sizeof(size_t)),
+        count
+    };
+    size_t used = 0;
+
+    //Step1: ask for every range in a single request, with a body sized
+    //to each range waiting for its bytes
+    for (int i = 0; i < count; ++i) {
+        Task *task = batch->batch[i];
+        if (i > 0) {
+            ranges[used++] = ',';
+        }
+        format_range(task, ranges + used, 48);
+        used += strlen(ranges + used);
+
+        placement.capacities[i] = task->max_range >= 0 ? task->max_range - task->min_range + 1 : BUFSIZ;
+        placement.bodies[i] = malloc(placement.capacities[i]);
+    }
+
+    //Step2: stream the parts into place
+    int rc = http_url_parts(batch->url, ranges, place_part, &placement);
+
+    //Step3: hand over every body which was filled completely
+    for (int i = 0; i < count; ++i) {
+        Task *task = batch->batch[i];
+        size_t length = placement.filled[i];
+        int whole = task->max_range >= 0 ? length == placement.capacities[i] : length > 0;
+
+        if (rc == 0 && whole) {
+            Segment *segment = segment_new(placement.bodies[i], release_memory, NULL);
+            task->body = segment_slice(segment, placement.bodies[i], length);
+            segment_release(segment);
+        }
+        else {
+            free(placement.bodies[i]);
+        }
+        complete_task(context, task);
+    }
+
+    free(placement.bodies);
+    free(placement.capacities);
+    free(placement.filled);
+    free(ranges);
+    free_task(batch);
+}
+
+
+/**
+ * Stream a task's range into its sink through a pooled, aligned segment.
+ * The unaligned head of the range is written on its own so every full
+ * segment after it lands on an aligned file offset, letting SINK_DIRECT
+ * write it with O_DIRECT. Written regions are released from the page
+ * cache one segment behind, so their writeback overlaps the next receive.
+ * @param context - The worker context
+ * @param task - The task, limit holds the number of bytes it owns
+ * @return long - The bytes written or -1 on failure, including a body
+ *                which ended before all of the bytes the task owns
+ */
+long receive_into_sink(Context *context, Task *task) {
+    char range[64];
+    long offset = task->min_range, end = task->min_range + task->limit;
+    long segment_offset, released = task->min_range;
+    size_t segment_size = pool_segment_size(context->segments), filled = 0;
+    long read_count = 1;    //Last read, 0 at the end of the body, -1 on failure
+
+    format_range(task, range, sizeof range);
+    HttpStream *stream = http_stream_open(task->url, range);
+    if (stream == NULL) {
+        return -1;
+    }
+    char *segment = pool_get(context->segments);
+
+    //Step1: the unaligned head, up to the next aligned offset
+    long head_end = (offset + SINK_ALIGN - 1) / SINK_ALIGN * SINK_ALIGN;
+    if (head_end > end) {
+        head_end = end;
+    }
+    while (offset < head_end && (read_count = http_stream_read(stream, segment, head_end - offset)) > 0) {
+        if (sink_write(task->sink, offset, segment, read_count) != 0) {
+            read_count = -1;
+            break;
+        }
+        offset += read_count;
+    }
+
+    //Step2: whole segments from the aligned offset on
+    segment_offset = offset;
+    while (read_count > 0 && offset < end) {
+        size_t want = segment_size - filled;
+        if (want > end - offset) {
+            want = end - offset;
+        }
+
+        read_count = http_stream_read(stream, segment + filled, want);
+        if (read_count <= 0) {
+            break;
+        }
+        filled += read_count;
+        offset += read_count;
+
+        if (filled == segment_size) {
+            if (sink_write(task->sink, segment_offset, segment, filled) != 0) {
+                read_count = -1;
+                break;
+            }
+            sink_release(task->sink, released, segment_offset - released);
+            released = segment_offset;
+            segment_offset += filled;
+            filled = 0;
+        }
+    }
+
+    //Step3: the last partial segment, whose tail may be unaligned
+    if (read_count >= 0 && filled > 0
+        && sink_write(task->sink, segment_offset, segment, filled) != 0) {
+        read_count = -1;
+    }
+    sink_release(task->sink, released, offset - released);
+
+    pool_put(context->segments, segment);
+    http_stream_close(stream);
+
+    return read_count < 0 || offset != end ? -1 : offset - task->min_range;
+}
+
+
+/**
+ * Receive a task's response into a segment of the result pool, which
+ * plan_results sized for it, so the hot path does no malloc, realloc or free
+ * @param context - The worker context
+ * @param task - The task to fetch, its size known
+ * @param range - The task's range
+ * @param response - Set to the response, inside the pooled segment
+ * @return int - 0 on success, -1 on failure
+ */
+int receive_pooled(Context *context, Task *task, const char *range, Buffer *response) {
+    if (task_need(task) + HEADER_ROOM > (long)pool_segment_size(context->results)) {
+        fprintf(stderr, "no result segment large enough for: %s\n", task->url);
+        return -1;
+    }
+
+    char *segment = pool_get(context->results);
+    if (http_url_buffer(task->url, range, task->limit, segment,
+        pool_segment_size(context->results), response) != 0) {
+        pool_put(context->results, segment);
+        return -1;
+    }
+
+    take_body(task, response, release_to_pool, context->results);
+    return 0;
+}
+
+
+/**
+ * Tell the workers that tasks reached an inbox, deque or the chunks,
+ * waking the idle ones so they look for them straight away
+ * @param context - The worker context
+ */
+void announce_work(Context *context) {
+    pthread_mutex_lock(&context->work_lock);
+    __atomic_add_fetch(&context->work_seq, 1, __ATOMIC_RELEASE);
+    if (context->idle > 0) {
+        pthread_cond_broadcast(&context->work_ready);
+    }
+    pthread_mutex_unlock(&context->work_lock);
+}
+
+
+/**
+ * Hand a task to the workers, round-robin over their inboxes
+ * @param context - The worker context
+ * @param task - The task, NULL to stop a worker
+ */
+void submit_task(Context *context, Task *task) {
+    spmc_put(context->inboxes[context->next_worker], task);
+    context->next_worker = (context->next_worker + 1) % context->num_workers;
+    announce_work(context);
+}
+
+
+/**
+ * Hand several tasks to the workers round-robin, each worker's share of
+ * them put into its inbox in one go. A share larger than an inbox goes
+ * in inbox-sized pieces, each announced before the next may block, so a
+ * sleeping worker is never left behind a full inbox it was not told of.
+ * @param context - The worker context
+ * @param tasks - The tasks
+ * @param count - The number of tasks
+ */
+void submit_tasks(Context *context, void **tasks, int count) {
+    int num_workers = context->num_workers;
+    void **share = (void**)malloc(sizeof(void*) * (count / num_workers + 1));
+
+    for (int w = 0; w < num_workers && w < count; ++w) {
+        Spmc *inbox = context->inboxes[(context->next_worker + w) % num_workers];
+        int n = 0;
+        for (int i = w; i < count; i += num_workers) {
+            share[n++] = tasks[i];
+        }
+        for (int i = 0; i < n; i += context->inbox_size) {
+            spmc_put_many(inbox, share + i, n - i < context->inbox_size ? n - i : context->inbox_size);
+            announce_work(context);
+        }
+    }
+    free(share);
+
+    context->next_worker = (context->next_worker + count) % num_workers;
+}
+
+
+/**
+ * Find a worker its next task: its own newest, else the first of what the
+ * main thread handed it with the rest moved into its deque where idle
+ * workers can steal them, else a queued chunk made into a task, else the
+ * oldest task of another worker.
+ * Sleeps when there is nothing anywhere until work is announced, then
+ * looks everywhere again.
+ * @param context - The worker context
+ * @param id - The index of the worker
+ * @param stopping - Set once the worker was told to stop
+ * @return task - The task, NULL once stopped with nothing left
+ */
+Task *next_task(Context *context, int id, int *stopping) {
+    Deque *deque = context->deques[id];
+    void *item;
+    Task *task;
+
+    while (1) {
+        //Work announced from here on wakes the sleep of step 5
+        long seen = __atomic_load_n(&context->work_seq, __ATOMIC_ACQUIRE);
+
+        //Step1: own tasks first
+        if ((task = (Task *)deque_pop(deque)) != NULL) {
+            return task;
+        }
+
+        //Step2: tasks handed over by the main thread, the deque being empty
+        int moved = 0;
+        task = NULL;
+        while (!*stopping && moved < DEQUE_SIZE && spmc_try_get(context->inboxes[id], &item) == 0) {
+            if (item == NULL) {
+                *stopping = 1;
+            }
+            else if (task == NULL) {
+                task = (Task *)item;
+            }
+            else {
+                deque_push(deque, item);
+                ++moved;
+            }
+        }
+        if (moved > 0) {
+            announce_work(context);
+        }
+        if (task) {
+            return task;
+        }
+
+        //Step3: a chunk queued by value
+        Chunk chunk;
+        if (ChunkQueue_try_get(context->chunks, &chunk) == 0) {
+            task = new_task(chunk.url, chunk.min_range, chunk.max_range);
+            task->limit = chunk.limit;
+            return task;
+        }
+
+        //Step4: the oldest task of another worker, sweeping again while a
+        //steal lost a race as the deque it lost on may hold more
+        int lost;
+        do {
+            lost = 0;
+            for (int i = 1; i < context->num_workers; ++i) {
+                if ((task = (Task *)deque_steal(context->deques[(id + i) % context->num_workers], &lost)) != NULL) {
+                    return task;
+                }
+            }
+        } while (lost);
+
+        if (*stopping) {
+            return NULL;
+        }
+
+        //Step5: sleep until tasks reach an inbox, deque or the chunks
+        pthread_mutex_lock(&context->work_lock);
+        ++context->idle;
+        while (__atomic_load_n(&context->work_seq, __ATOMIC_ACQUIRE) == seen) {
+            pthread_cond_wait(&context->work_ready, &context->work_lock);
+        }
+        --context->idle;
+        pthread_mutex_unlock(&context->work_lock);
+    }
+}
+
+
 void *worker_thread(void *arg) {
     Context *context = (Context *)arg;
+    int id = __atomic_fetch_add(&context->started, 1, __ATOMIC_RELAXED), stopping = 0;
 
-    Task *task = (Task *)queue_get(context->todo);
+    Task *task = next_task(context, id, &stopping);
     char *range = (char *)malloc(1024 * sizeof(char));
     
     while (task) {
-        snprintf(range, 1024 * sizeof(char), "%d-%d", task->min_range, 
-        task->max_range);
+        if (task->multi_range) {
+            reserve_task(context, task);
+            run_multi_range(context, task);
+            task = next_task(context, id, &stopping);
+            continue;
+        }
+
+        if (task->batch) {
+            run_batch(context, task);
+            task = next_task(context, id, &stopping);
+            continue;
+        }
+
+        //Ranges known to be past the end of the file are not fetched
+        if (task->max_range == OPEN_ENDED && get_known_size(context) >= 0
+            && task->min_range >= get_known_size(context)) {
+            task->canceled = 1;
+            complete_task(context, task);
+            task = next_task(context, id, &stopping);
+            continue;
+        }
+
+        format_range(task, range, 1024 * sizeof(char));
+        reserve_task(context, task);
     
-        task->result = http_url(task->url, range);
+        if (task->dest || task->sink) {
+            if (task->dest) {
+                task->received = http_url_into(task->url, range, task->dest, task->limit);
+            }
+            else {
+                task->received = receive_into_sink(context, task);
+            }
+            complete_task(context, task);
+            task = next_task(context, id, &stopping);
+            continue;
+        }
 
-        queue_put(context->done, task);
-        task = (Task *)queue_get(context->todo);
+        //Nothing bounds the body of a file of unknown length, so it grows as it comes
+        Buffer pooled, *response = NULL;
+        if (task->limit <= 0 && task->max_range < 0) {
+            response = http_url_limit(task->url, range, task->limit);
+            if (response) {
+                take_body(task, response, release_buffer, response);
+            }
+        }
+        else if (receive_pooled(context, task, range, &pooled) == 0) {
+            response = &pooled;
+        }
+
+        //The body's slice keeps the response alive until here
+        if (task->max_range == OPEN_ENDED) {
+            learn_size(context, task, response);
+        }
+        else if (response && !http_status_matches(http_get_status(response), range)) {
+            slice_release(&task->body);
+        }
+
+        complete_task(context, task);
+        task = next_task(context, id, &stopping);
     }
     
     free(range);
@@ -64,13 +959,474 @@ void *worker_thread(void *arg) {
 }
 
 
-Context *spawn_workers(int num_workers) {
+/**
+ * Find the body of a task
+ * @param task - The task
+ * @param length - Set to the length of the body
+ * @return char* - The body, NULL if the task has nothing to write
+ */
+char *task_body(Task *task, size_t *length) {
+    if (task->canceled || task->body.segment == NULL) {
+        return NULL;
+    }
+
+    *length = task->body.length;
+    return task->body.data;
+}
+
+
+/**
+ * Whether a task's body continues where another's ends in the same file.
+ * Chunks overlap the next by a byte, so touching or overlapping counts.
+ */
+int adjacent(Task *task, Task *next) {
+    size_t length;
+
+    return next->file == task->file && task_body(task, &length)
+        && next->min_range > task->min_range
+        && next->min_range <= task->min_range + (long)length;
+}
+
+
+/**
+ * Stage a task for the writers, keeping the staged list sorted by offset.
+ * The caller holds staged_lock.
+ */
+void stage_task(Context *context, Task *task) {
+    Task **link = &context->staged;
+
+    while (*link && (*link)->min_range < task->min_range) {
+        link = &(*link)->next;
+    }
+    task->next = *link;
+    *link = task;
+}
+
+
+/**
+ * Unlink the run of adjacent staged tasks holding task once it spans at
+ * least min_bytes. The caller holds staged_lock.
+ * @param context - The worker context
+ * @param task - A staged task
+ * @param min_bytes - The fewest bytes worth a write
+ * @return Task* - The first task of the run, linked by next, or NULL
+ */
+Task *take_run(Context *context, Task *task, long min_bytes) {
+    Task **start = &context->staged;
+    size_t length;
+
+    while (*start) {
+        Task *last = *start;
+        int found = last == task;
+
+        while (last->next && adjacent(last, last->next)) {
+            last = last->next;
+            found |= last == task;
+        }
+
+        if (found) {
+            task_body(last, &length);
+            if (last->min_range + (long)length - (*start)->min_range < min_bytes) {
+                return NULL;
+            }
+
+            Task *run = *start;
+            *start = last->next;
+            last->next = NULL;
+            return run;
+        }
+        start = &last->next;
+    }
+    return NULL;
+}
+
+
+/**
+ * Unlink every staged task of a file. The caller holds staged_lock.
+ * @param context - The worker context
+ * @param file - The file
+ * @return Task* - The first task, linked by next in offset order, or NULL
+ */
+Task *take_file(Context *context, WriteFile *file) {
+    Task *taken = NULL, **tail = &taken, **link = &context->staged;
+
+    while (*link) {
+        Task *task = *link;
+        if (task->file == file) {
+            *link = task->next;
+            task->next = NULL;
+            *tail = task;
+            tail = &task->next;
+        }
+        else {
+            link = &task->next;
+        }
+    }
+    return taken;
+}
+
+
+/**
+ * Write all of an iovec array at an offset, retrying short writes
+ * @return int - 0 on success, -1 on failure
+ */
+int pwritev_all(int fd, struct iovec *iov, int count, long offset) {
+    while (count > 0) {
+        ssize_t written = pwritev(fd, iov, count, offset);
+        count_file_syscalls(1);
+        if (written < 0) {
+            return -1;
+        }
+        offset += written;
+
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * Write tasks into their file at their offsets, each run of adjacent
+ * tasks with one pwritev. Every task of a run but the last only writes
+ * up to where the next one starts.
+ * @param list - Tasks with bodies sorted by offset, linked by next
+ */
+void write_tasks(Task *list) {
+    struct iovec iov[WRITE_IOVECS];
+    size_t length;
+
+    while (list) {
+        Task *first = list, *task = list;
+        int count = 0;
+
+        //Step1: gather the run into an iovec array
+        while (1) {
+            iov[count].iov_base = task_body(task, &length);
+            int more = task->next && adjacent(task, task->next) && count < WRITE_IOVECS - 1;
+            if (more) {
+                length = task->next->min_range - task->min_range;
+            }
+            iov[count++].iov_len = length;
+            task->received = length;
+
+            if (!more) {
+                break;
+            }
+            task = task->next;
+        }
+        list = task->next;
+
+        //Step2: write it in one go
+        if (pwritev_all(first->file->fd, iov, count, first->min_range) != 0) {
+            perror("pwritev");
+            for (task = first; task != list; task = task->next) {
+                task->received = -1;
+            }
+        }
+    }
+}
+
+
+/**
+ * Take completed tasks off the writes queue and write them into their
+ * file. A task is staged until the run of adjacent tasks it belongs to
+ * is worth a write or every task of its file has arrived, so small
+ * neighbouring chunks go out together. Written tasks go on to done.
+ * @param arg - The worker context
+ */
+void *writer_thread(void *arg) {
+    Context *context = (Context *)arg;
+    size_t length;
+
+    Task *task = (Task *)queue_get(context->writes);
+    while (task) {
+        WriteFile *file = task->file;
+        int staged = task_body(task, &length) != NULL;
+        Task *ready;
+
+        if (!staged && !task->canceled) {
+            task->received = -1;
+        }
+
+        //Step1: stage it and take whatever is ready to write
+        pthread_mutex_lock(&context->staged_lock);
+        --file->outstanding;
+        if (staged) {
+            stage_task(context, task);
+        }
+        if (file->outstanding == 0) {
+            ready = take_file(context, file);
+        }
+        else if (staged) {
+            //Under a memory budget, a held task could be waiting on tasks
+            //the budget keeps from starting, so nothing is held back
+            ready = take_run(context, task,
+                budget_limit(context->budget) > 0 ? 0 : WRITE_BATCH);
+        }
+        else {
+            ready = NULL;
+        }
+        pthread_mutex_unlock(&context->staged_lock);
+
+        //Step2: write, then hand everything back to the main thread
+        write_tasks(ready);
+        while (ready) {
+            Task *next = ready->next;
+            release_task(context, ready);
+            mpsc_put(context->done, ready);
+            ready = next;
+        }
+        if (!staged) {
+            mpsc_put(context->done, task);
+        }
+
+        task = (Task *)queue_get(context->writes);
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Count tasks about to be issued for the file the writers write into,
+ * so they know when the last of its tasks has reached them
+ * @param context - The worker context
+ * @param count - The number of tasks
+ */
+void expect_tasks(Context *context, int count) {
+    if (context->output) {
+        pthread_mutex_lock(&context->staged_lock);
+        context->output->outstanding += count;
+        pthread_mutex_unlock(&context->staged_lock);
+    }
+}
+
+
+/**
+ * The path a url is saved under in a directory, its '/'s turned into
+ * '-'s to avoid unrecognized directories
+ * @param path - Where the path is stored, FILE_SIZE bytes
+ * @param dir - The download directory
+ * @param url - The url
+ * @return int - 0 on success, -1 if the path does not fit
+ */
+int url_file_path(char *path, const char *dir, const char *url) {
+    int length = snprintf(path, FILE_SIZE, "%s/%s", dir, url);
+
+    if (length < 0 || length >= FILE_SIZE) {
+        fprintf(stderr, "path too long for: %s\n", url);
+        return -1;
+    }
+    for (char *c = path + strlen(dir) + 1; *c != '\0'; ++c) {
+        if (*c == '/') {
+            *c = '-';
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * Create the final file of a url for the writers, which then write its
+ * chunks into it at their offsets instead of into chunk files to merge
+ * @param context - The worker context
+ * @param download_dir - The directory to write the file into
+ * @param url - The url of the file
+ */
+void open_output(Context *context, const char *download_dir, char *url) {
+    char write_file_path[FILE_SIZE];
+
+    if (url_file_path(write_file_path, download_dir, url) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    WriteFile *file = (WriteFile*)malloc(sizeof(WriteFile));
+    file->fd = open(write_file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    file->outstanding = 0;
+    count_file_syscalls(1);
+    if (file->fd < 0) {
+        fprintf(stderr, "error writing to: %s\n", write_file_path);
+        exit(EXIT_FAILURE);
+    }
+
+    context->output = file;
+}
+
+
+/**
+ * Close the file the writers wrote the current url into, once all of
+ * its tasks are done
+ * @param context - The worker context
+ */
+void close_output(Context *context) {
+    close(context->output->fd);
+    count_file_syscalls(1);
+    free(context->output);
+    context->output = NULL;
+}
+
+
+/**
+ * The largest file put together in memory: the requested size, else a
+ * segment per connection, and at most half the memory budget so the
+ * chunks still fit beside the buffer they are copied into
+ * @param requested - The size asked for, -1 to choose one
+ * @param num_workers - The number of connections
+ * @param budget - The memory budget, 0 for no limit
+ * @return long - The threshold in bytes
+ */
+long assembly_threshold(long requested, int num_workers, long budget) {
+    long threshold = requested >= 0 ? requested : (long)num_workers * SEGMENT_SIZE;
+
+    if (budget > 0 && threshold > budget / 2) {
+        threshold = budget / 2;
+    }
+    return threshold;
+}
+
+
+/**
+ * Size the result pool for the largest body a url's tasks receive, so
+ * each of them fits a segment. Segments grow for a url which needs more
+ * and shrink once they are over twice what it needs, so one huge file
+ * does not pin its segments for the rest of the run. Only called between
+ * urls, when no segment is checked out.
+ * @param context - The worker context
+ * @param largest - The largest body of the url's tasks
+ */
+void plan_results(Context *context, long largest) {
+    size_t want = largest + HEADER_ROOM;
+    size_t size = pool_segment_size(context->results);
+
+    if (want < RESULT_SEGMENT) {
+        want = RESULT_SEGMENT;
+    }
+    if (size < want || size > 2 * want) {
+        pool_resize(context->results, want);
+    }
+}
+
+
+/**
+ * Put the current url together in memory: wait_task copies its chunks
+ * into one buffer, written out at once by close_assembly, instead of
+ * into chunk files to merge
+ * @param context - The worker context
+ * @param size - The size of the file
+ * @return int - 0 on success, -1 if there is no memory for the buffer
+ */
+int open_assembly(Context *context, long size) {
+    context->assembly = (char*)malloc(size);
+    if (context->assembly == NULL) {
+        return -1;
+    }
+    context->assembly_size = size;
+    budget_charge(context->budget, size);
+    return 0;
+}
+
+
+/**
+ * Free the buffer the current url was put together in
+ * @param context - The worker context
+ */
+void drop_assembly(Context *context) {
+    free(context->assembly);
+    budget_release(context->budget, context->assembly_size);
+    context->assembly = NULL;
+    context->assembly_size = 0;
+}
+
+
+/**
+ * Write the url put together in memory into its final file with a single
+ * write, once all of its tasks are done
+ * @param context - The worker context
+ * @param download_dir - The directory to write the file into
+ * @param url - The url of the file
+ */
+void close_assembly(Context *context, const char *download_dir, char *url) {
+    char write_file_path[FILE_SIZE];
+
+    if (url_file_path(write_file_path, download_dir, url) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    int fd = open(write_file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, context->assembly, context->assembly_size) != context->assembly_size) {
+        fprintf(stderr, "error writing to: %s\n", write_file_path);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    count_file_syscalls(3);
+
+    drop_assembly(context);
+}
+
+
+Context *spawn_workers(int num_workers, int pipeline_depth, int num_writers, long budget, int queue_stats) {
     Context *context = (Context*)malloc(sizeof(Context));
 
-    context->todo = queue_alloc(num_workers * 2);
-    context->done = queue_alloc(num_workers * 2);
+    context->inboxes = (Spmc**)malloc(sizeof(Spmc*) * num_workers);
+    context->deques = (Deque**)malloc(sizeof(Deque*) * num_workers);
+    context->inbox_size = num_workers * 2;
+    for (int i = 0; i < num_workers; ++i) {
+        context->inboxes[i] = spmc_alloc(context->inbox_size);
+        context->deques[i] = deque_alloc(DEQUE_SIZE);
+    }
+    context->chunks = ChunkQueue_alloc(context->inbox_size);
+    pthread_mutex_init(&context->work_lock, NULL);
+    pthread_cond_init(&context->work_ready, NULL);
+    context->work_seq = 0;
+    context->idle = 0;
+    context->next_worker = 0;
+    context->started = 0;
+    context->batches_taken = 0;
+    context->done = mpsc_alloc(num_workers * 2);
+    context->failures = 0;
+    context->job = 0;
+    context->queue_stats = queue_stats;
+    if (queue_stats) {
+        for (int i = 0; i < num_workers; ++i) {
+            spmc_enable_stats(context->inboxes[i]);
+        }
+        mpsc_enable_stats(context->done);
+    }
 
     context->num_workers = num_workers;
+    context->pipeline_depth = pipeline_depth;
+
+    pthread_mutex_init(&context->lock, NULL);
+    context->known_size = -1;
+    context->segments = pool_alloc(SEGMENT_SIZE, SINK_ALIGN);
+    context->results = pool_alloc_huge(RESULT_SEGMENT);
+    context->budget = budget_alloc(budget);
+
+    pthread_mutex_init(&context->staged_lock, NULL);
+    context->staged = NULL;
+    context->output = NULL;
+    context->assembly = NULL;
+    context->assembly_size = 0;
+    context->num_writers = num_writers;
+    context->writes = num_writers > 0 ? queue_alloc(num_writers * 2) : NULL;
+    if (queue_stats && context->writes) {
+        queue_enable_stats(context->writes);
+    }
+    context->writers = (pthread_t*)malloc(sizeof(pthread_t) * num_writers);
+    for (int i = 0; i < num_writers; ++i) {
+        if (pthread_create(&context->writers[i], NULL, writer_thread, context) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
 
     context->threads = (pthread_t*)malloc(sizeof(pthread_t) * num_workers);
     int i = 0;
@@ -82,16 +1438,42 @@ Context *spawn_workers(int num_workers) {
         }
     }
 
-    return context;
+    return context;
+}
+
+/**
+ * Print what the queues did: the inboxes, summed over the workers, show
+ * whether workers waited for tasks, the done queue whether they waited
+ * for the main thread
+ * @param context - The worker context, its threads joined
+ */
+void print_queue_stats(Context *context) {
+    QueueStats total = { 0 }, stats;
+
+    for (int i = 0; i < context->num_workers; ++i) {
+        spmc_stats(context->inboxes[i], &stats);
+        queue_stats_add(&total, &stats);
+    }
+    queue_print_stats("inboxes", &total);
+
+    mpsc_stats(context->done, &stats);
+    queue_print_stats("done", &stats);
+
+    if (context->writes) {
+        queue_stats(context->writes, &stats);
+        queue_print_stats("writes", &stats);
+    }
 }
 
+
 void free_workers(Context *context) {
     int num_workers = context->num_workers;
     int i = 0;
 
     for (i = 0; i < num_workers; ++i) {
-        queue_put(context->todo, NULL);
+        spmc_put(context->inboxes[i], NULL);
     }
+    announce_work(context);
 
     for (i = 0; i < num_workers; ++i) {
         if (pthread_join(context->threads[i], NULL) != 0) {
@@ -100,54 +1482,155 @@ void free_workers(Context *context) {
         }
     }
 
-    queue_free(context->todo);
-    queue_free(context->done);
+    //Workers are gone, so nothing more reaches the writers
+    for (i = 0; i < context->num_writers; ++i) {
+        queue_put(context->writes, NULL);
+    }
+    for (i = 0; i < context->num_writers; ++i) {
+        if (pthread_join(context->writers[i], NULL) != 0) {
+            perror("pthread_join");
+            exit(1);
+        }
+    }
+
+    if (context->queue_stats) {
+        print_queue_stats(context);
+    }
+
+    for (i = 0; i < num_workers; ++i) {
+        spmc_free(context->inboxes[i]);
+        deque_free(context->deques[i]);
+    }
+    free(context->inboxes);
+    free(context->deques);
+    ChunkQueue_free(context->chunks);
+    mpsc_free(context->done);
+    if (context->writes) {
+        queue_free(context->writes);
+    }
+    pthread_mutex_destroy(&context->lock);
+    pthread_mutex_destroy(&context->staged_lock);
+    pthread_mutex_destroy(&context->work_lock);
+    pthread_cond_destroy(&context->work_ready);
+    pool_free(context->segments);
+    pool_free(context->results);
+    budget_free(context->budget);
+    free(context->writers);
 
     free(context->threads);
     free(context);
 }
 
 
-Task *new_task(char *url, int min_range, int max_range) {
-    Task *task = malloc(sizeof(Task));
-    task->result = NULL;
-    task->url = malloc(strlen(url) + 1);
-    task->min_range = min_range;
-    task->max_range = max_range;
-
-    strcpy(task->url, url);
+/**
+ * The path of the temporary file holding a chunk of a url. Chunks are
+ * named after their url, the job downloading it and their offset, so the
+ * chunks of a url still being merged never collide with those of the
+ * next one, even when the url file lists the same url again.
+ * @param path - Where the path is stored, FILE_SIZE bytes
+ * @param dir - The download directory
+ * @param url - The url the chunk belongs to
+ * @param job - The index of the url in the url file
+ * @param offset - The chunk's offset in the file
+ * @return int - 0 on success, -1 if the path does not fit
+ */
+int chunk_file_path(char *path, const char *dir, const char *url, int job, long offset) {
+    if (url_file_path(path, dir, url) != 0) {
+        return -1;
+    }
 
-    return task;
+    size_t length = strlen(path);
+    int suffix = snprintf(path + length, FILE_SIZE - length, ".%d.%ld.part", job, offset);
+    if (suffix < 0 || suffix >= FILE_SIZE - length) {
+        fprintf(stderr, "path too long for: %s\n", url);
+        return -1;
+    }
+    return 0;
 }
 
-void free_task(Task *task) {
 
-    if (task->result) {
-        free(task->result->data);
-        free(task->result);
-    }
+/**
+ * Throw away what a failed url left behind, since any missing chunk
+ * leaves a hole: the buffer it was put together in, the final file the
+ * writers wrote into, or else its chunk files
+ * @param context - The worker context
+ * @param download_dir - The directory the url was written into
+ * @param url - The url of the file
+ * @param bytes - The max chunk size
+ * @param num_tasks - The number of chunks
+ */
+void discard_url(Context *context, const char *download_dir, char *url, long bytes, int num_tasks) {
+    char path[FILE_SIZE];
 
-    free(task->url);
-    free(task);
+    if (context->assembly) {
+        drop_assembly(context);
+    }
+    else if (context->output) {
+        close_output(context);
+        if (url_file_path(path, download_dir, url) == 0) {
+            unlink(path);
+            count_file_syscalls(1);
+        }
+    }
+    else {
+        //Chunks which never arrived have no file, so ignore the misses
+        for (int i = 0; i < num_tasks; ++i) {
+            if (chunk_file_path(path, download_dir, url, context->job, i * bytes) == 0) {
+                unlink(path);
+                count_file_syscalls(1);
+            }
+        }
+    }
 }
 
 
-void wait_task(const char *download_dir, Context *context) {
-    char filename[FILE_SIZE], url_file[FILE_SIZE];
-    Task *task = (Task*)queue_get(context->done);
-
-    if (task->result) {
+/**
+ * Report a task which came back on the done queue and write out its
+ * body, then free it
+ * @param download_dir - The directory to write into
+ * @param context - The worker context
+ * @param task - The done task
+ */
+void finish_task(const char *download_dir, Context *context, Task *task) {
+    char filename[FILE_SIZE];
 
-        snprintf(url_file, FILE_SIZE * sizeof(char), "%d", task->min_range);
-        size_t len = strlen(url_file);
-        for (int i = 0; i < len; ++i) {
-            if (url_file[i] == '/') {
-                url_file[i] = '|';
-            }
+    if (task->canceled) {
+        //Over-issued range, nothing to write
+    }
+    else if (task->dest || task->sink || task->file) {
+        //Already received in place or written by a writer
+        if (task->received >= 0) {
+            bytes_downloaded += task->received;
+            printf("downloaded %ld bytes from %s\n", task->received, task->url);
+        }
+        else {
+            fprintf(stderr, "error downloading: %s\n", task->url);
+            ++context->failures;
+        }
+    }
+    else if (task->body.segment && context->assembly && task->max_range != WHOLE_FILE) {
+        //Copy the chunk into place; chunks overlap the next by a byte
+        size_t length = task->body.length;
+        long room = context->assembly_size - task->min_range;
+
+        if (room > 0) {
+            memcpy(context->assembly + task->min_range, task->body.data,
+                length < room ? length : room);
         }
+        bytes_downloaded += length;
 
+        printf("downloaded %zu bytes from %s\n", length, task->url);
+    }
+    else if (task->body.segment) {
+
+        //Whole files are written under their final name, chunks by url and offset
+        int rc = task->max_range == WHOLE_FILE
+            ? url_file_path(filename, download_dir, task->url)
+            : chunk_file_path(filename, download_dir, task->url, context->job, task->min_range);
+        if (rc != 0) {
+            exit(EXIT_FAILURE);
+        }
 
-        snprintf(filename, FILE_SIZE, "%s/%s", download_dir, url_file);
         FILE *fp = fopen(filename, "w");
 
         if (fp == NULL) {
@@ -155,127 +1638,637 @@ void wait_task(const char *download_dir, Context *context) {
             exit(EXIT_FAILURE);
         }
 
-        char *data = http_get_content(task->result);
-        if (data) {
-            size_t length = task->result->length - (data - task->result->data);
+        size_t length = task->body.length;
 
-            fwrite(data, 1, length, fp);
-            fclose(fp);
+        fwrite(task->body.data, 1, length, fp);
+        fclose(fp);
+        count_file_syscalls(3);
+        bytes_downloaded += length;
 
-            printf("downloaded %d bytes from %s\n", (int)length, task->url);
-        }
-        else {
-            printf("error in response from %s\n", task->url);
-        }
+        printf("downloaded %zu bytes from %s\n", length, task->url);
 
     }
     else {
 
         fprintf(stderr, "error downloading: %s\n", task->url);
+        ++context->failures;
 
     }
 
+    release_task(context, task);
     free_task(task);
 }
 
 
+/**
+ * Wait for a number of tasks by polling the done queue's eventfd, which
+ * other file descriptors could share the wait with, and take whatever is
+ * done in one go. While nothing comes back, progress is reported every
+ * PROGRESS_INTERVAL.
+ * @param download_dir - The directory to write into
+ * @param context - The worker context
+ * @param count - The number of tasks to wait for
+ */
+void wait_tasks(const char *download_dir, Context *context, int count) {
+    void *tasks[WAIT_BATCH];
+    struct pollfd done = { mpsc_eventfd(context->done), POLLIN, 0 };
+
+    while (count > 0) {
+        int ready = poll(&done, 1, PROGRESS_INTERVAL);
+        if (ready < 0 && errno != EINTR) {
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+        if (ready == 0) {
+            printf(">>waiting for %d chunks, %ld bytes downloaded so far\n", count, bytes_downloaded);
+            continue;
+        }
+
+        int n = mpsc_drain(context->done, tasks, count < WAIT_BATCH ? count : WAIT_BATCH);
+        for (int i = 0; i < n; ++i) {
+            finish_task(download_dir, context, (Task*)tasks[i]);
+        }
+        count -= n;
+    }
+}
+
+
+/**
+ * Copy bytes from the current position of one file to the current
+ * position of another with copy_file_range, which copies in the kernel
+ * (or on the server, or shares extents by reflink where the file system
+ * can) instead of through a user space buffer. Falls back to read and
+ * write where copy_file_range is not supported between the files.
+ * @param in_fd - The file to copy from
+ * @param out_fd - The file to copy to
+ * @param length - The most bytes to copy, stopping early at end of file
+ * @return int - 0 on success, -1 on failure
+ */
+int copy_chunk(int in_fd, int out_fd, size_t length) {
+    while (length > 0) {
+        ssize_t copied = copy_file_range(in_fd, NULL, out_fd, NULL, length, 0);
+        count_file_syscalls(1);
+        if (copied == 0) {
+            return 0;
+        }
+        if (copied > 0) {
+            length -= copied;
+            continue;
+        }
+        if (errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP && errno != EINVAL) {
+            return -1;
+        }
+
+        //No in-kernel copy between these files, copy through a buffer
+        char data[BUFSIZ];
+        ssize_t read_count;
+        while (length > 0 && (read_count = read(in_fd, data,
+            length < BUFSIZ ? length : BUFSIZ)) > 0) {
+            if (write(out_fd, data, read_count) != read_count) {
+                return -1;
+            }
+            length -= read_count;
+            count_file_syscalls(2);
+        }
+        return read_count < 0 ? -1 : 0;
+    }
+    return 0;
+}
+
+
 /**
  * Merge all files in from src to file with name dest synchronously
- * by reading each file, and writing its contents to the dest file.
+ * by copying each chunk file into the dest file with copy_chunk.
  * @param src - char pointer to src directory holding files to merge
  * @param dest - char pointer to name of file resulting from merge
+ * @param job - The index of the url the chunks were downloaded for
  * @param bytes - The maximum byte size downloaded
  * @param tasks - The tasks needed for the multipart download
+ * @return int - 0 on success, -1 if a chunk could not be merged, leaving
+ *               no final file
  */
-void merge_files(char *src, char *dest, int bytes, int tasks) {
-    // assert(0 && "not implemented yet!");
+int merge_files(char *src, char *dest, int job, long bytes, int tasks) {
     char write_file_path[FILE_SIZE];
-    
-    //Change '/' to '-' to avoid unrecognize direction
-    size_t len = strlen(dest);
-    for (int i = 0; i < len; ++i) {
-        if (dest[i] == '/') {
-            dest[i] = '-';
-        }
-    }
 
     //Combine direction for write file
-    snprintf(write_file_path, FILE_SIZE, "%s/%s", src, dest);
+    if (url_file_path(write_file_path, src, dest) != 0) {
+        return -1;
+    }
 
     //Open file for write
-    FILE *write_fp = fopen(write_file_path, "w");
+    int write_fd = open(write_file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 
-    if (write_fp == NULL) {
+    if (write_fd < 0) {
         fprintf(stderr, "error writing to: %s\n", dest);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
-    //Read one by one from all temp files the write into final file (merge data)
-    char *data = malloc(bytes);
+    //Copy the temp files one by one into the final file (merge data)
     for(int i = 0; i < tasks; i++){
         char read_file_path[FILE_SIZE];
-        char read_file_name[FILE_SIZE];
-
-        //Find temp file name and combine into direction path.
-        snprintf(read_file_name, FILE_SIZE * sizeof(char), "%d", i * bytes);
-        snprintf(read_file_path, FILE_SIZE, "%s/%s", src, read_file_name);
-
-        //Read temp file by max_chunk_size
-        FILE *read_fp = fopen(read_file_path, "r");
-        fread(data, bytes, 1, read_fp);
-        fclose(read_fp);
-
-        //If still have data, then write into merged file.
-        if(data) {
-            fwrite(data, 1, bytes, write_fp);
-        }else {
-            printf(">>Merge chunk file %s failed\n", dest);
-            exit(1);
+        int read_fd = chunk_file_path(read_file_path, src, dest, job, i * bytes) != 0 ? -1
+            : open(read_file_path, O_RDONLY);
+
+        //Chunks overlap the next by a byte, so copy max_chunk_size of
+        //each of them, but all of the last one which holds the remainder
+        size_t remaining = i < tasks - 1 ? bytes : (size_t)-1 / 2;
+        if (read_fd < 0 || copy_chunk(read_fd, write_fd, remaining) != 0) {
+            fprintf(stderr, ">>Merge chunk file %s failed\n", dest);
+            if (read_fd >= 0) {
+                close(read_fd);
+            }
+            close(write_fd);
+            unlink(write_file_path);
+            count_file_syscalls(3);
+            return -1;
         }
+        close(read_fd);
+        count_file_syscalls(2);
     }
     printf(">>Merge chunk file into '%s' successfully\n", write_file_path);
-    free(data);
-    fclose(write_fp);
+    close(write_fd);
+    count_file_syscalls(2);
+    return 0;
 }
 
 
 /**
  * Remove files caused by chunk downloading
  * @param dir - The directory holding the chunked files
+ * @param url - The url the chunks belong to
+ * @param job - The index of the url the chunks were downloaded for
  * @param bytes - The maximum byte size per file. Assumed to be filename
  * @param files - The number of chunked files to remove.
+ * @return int - 0 on success, -1 if any chunk file could not be removed
  */
-void remove_chunk_files(char *dir, int bytes, int files) {
-    // assert(0 && "not implemented yet!");
+int remove_chunk_files(char *dir, char *url, int job, long bytes, int files) {
+    int rc = 0;
+
     for(int i = 0; i < files; i++){
         char read_file_path[FILE_SIZE];
-        char read_file_name[FILE_SIZE];
 
-        //Find temp file name and combine into direction path.
-        snprintf(read_file_name, FILE_SIZE * sizeof(char), "%d", i * bytes);
-        snprintf(read_file_path, FILE_SIZE, "%s/%s", dir, read_file_name);
+        //Delete temp file by max_chunk_size, carrying on past a failure
+        count_file_syscalls(1);
+        if (chunk_file_path(read_file_path, dir, url, job, i * bytes) != 0
+            || remove(read_file_path) != 0) {
+            rc = -1;
+        }
+    }
+    printf(rc == 0 ? ">>Remove chunk file successfully\n" : ">>Remove chunk file failed\n");
+    return rc;
+}
 
-        //Delete temp file by max_chunk_size
-        if(remove(read_file_path) == 0){
-            // printf(">>Remove chunk file successfully\n");
-        }else{
-            printf(">>Remove chunk file failed\n");
-            exit(1);
+
+/**
+ * The last byte a chunk asks for. Chunks overlap the next by a byte,
+ * while the last chunk runs to the end of the file so no remainder of
+ * the split is lost.
+ * @param chunk - The index of the chunk
+ * @param num_tasks - The number of chunks the file is split into
+ * @param bytes - The max chunk size
+ * @return long - The last byte or OPEN_ENDED if the size is not known
+ */
+long chunk_max_range(int chunk, int num_tasks, long bytes) {
+    if (chunk < num_tasks - 1) {
+        return (chunk + 1) * bytes;
+    }
+    return get_content_size() > 0 ? get_content_size() - 1 : OPEN_ENDED;
+}
+
+
+/**
+ * Download a file of unknown length which accepts ranges by speculatively
+ * asking for chunk_size pieces at k * chunk_size onwards. The window of
+ * ranges issued ahead doubles while every range comes back full. The size
+ * learned from Content-Range or a short body stops further ranges and
+ * cancels any over-issued ones still queued. A failed range stops the
+ * download, since without it the size may never be learned.
+ * @param url - The url of the file
+ * @param download_dir - The directory to write the chunks into
+ * @param context - The worker context
+ * @param chunk_size - The size of each speculative range
+ * @return int - The number of chunks making up the file, -1 on failure
+ */
+int download_open_ended(char *url, const char *download_dir, Context *context, long chunk_size) {
+    int issued = 0, collected = 0, window = context->num_workers;
+    int failures = context->failures;
+    long size;
+
+    set_known_size(context, -1);
+
+    while (1) {
+        size = get_known_size(context);
+
+        //Step1: issue ranges up to the window, or up to the end once the
+        //size is known, keeping the queues from filling
+        while ((size < 0 ? issued < window : issued * chunk_size < size)
+            && issued - collected < context->num_workers * 2
+            && context->failures == failures) {
+            Chunk chunk = { url, (long)issued * chunk_size, OPEN_ENDED, chunk_size };
+            expect_tasks(context, 1);
+            ChunkQueue_put(context->chunks, &chunk);
+            announce_work(context);
+            ++issued;
+        }
+
+        if (collected == issued) {
+            break;
+        }
+
+        //Step2: collect one, growing the window once it all came back full
+        wait_tasks(download_dir, context, 1);
+        ++collected;
+
+        if (collected == window && get_known_size(context) < 0) {
+            window *= 2;
+        }
+    }
+
+    //Step3: on failure drop the chunks which did arrive
+    if (context->failures != failures) {
+        char path[FILE_SIZE];
+        for (int i = 0; i < issued && context->output == NULL; ++i) {
+            chunk_file_path(path, download_dir, url, context->job, (long)i * chunk_size);
+            unlink(path);
+        }
+        return -1;
+    }
+
+    size = get_known_size(context);
+    return size < 0 ? 0 : (size + chunk_size - 1) / chunk_size;
+}
+
+
+/**
+ * Download every url of the url file whole, without HEAD requests.
+ * Urls are grouped by host and each host's urls are spread over at most
+ * num_workers batches, each fetched over one keep-alive connection. The
+ * batches of all hosts are handed over before waiting for any of them.
+ * @param fp - The opened url file
+ * @param download_dir - The directory to write the files into
+ * @param context - The worker context
+ */
+void download_small_files(FILE *fp, const char *download_dir, Context *context) {
+    char **hosts = NULL, ***urls = NULL;
+    int *counts = NULL, num_hosts = 0;
+    char *line = NULL;
+    size_t len = 0;
+
+    //Step1: group the urls by host
+    while ((len = getline(&line, &len, fp)) != -1) {
+        if (line[len - 1] == '\n') {
+            line[len - 1] = '\0';
+        }
+
+        char *page = strstr(line, "/");
+        if (page == NULL) {
+            fprintf(stderr, "could not split url into host/page %s\n", line);
+            continue;
+        }
+
+        int host_len = page - line, h = 0;
+        while (h < num_hosts && (strlen(hosts[h]) != host_len
+            || strncmp(hosts[h], line, host_len) != 0)) {
+            ++h;
+        }
+
+        if (h == num_hosts) {
+            ++num_hosts;
+            hosts = realloc(hosts, sizeof(char*) * num_hosts);
+            urls = realloc(urls, sizeof(char**) * num_hosts);
+            counts = realloc(counts, sizeof(int) * num_hosts);
+            hosts[h] = strndup(line, host_len);
+            urls[h] = NULL;
+            counts[h] = 0;
+        }
+
+        urls[h] = realloc(urls[h], sizeof(char*) * (counts[h] + 1));
+        urls[h][counts[h]++] = strdup(line);
+    }
+
+    //Step2: fetch every host's urls over a few shared connections each,
+    //all hosts at once. Files are only taken off the done queue while the
+    //inboxes hold as many batches as they have room for, so the main
+    //thread never blocks handing over a batch with done files piling up.
+    int submitted = 0, outstanding = 0;
+    for (int h = 0; h < num_hosts; ++h) {
+        int num_batches = counts[h] < context->num_workers ? counts[h] : context->num_workers;
+
+        for (int b = 0; b < num_batches; ++b) {
+            int size = counts[h] / num_batches + (b < counts[h] % num_batches);
+            Task *batch = new_batch(urls[h][b], size);
+
+            for (int i = 0; i < size; ++i) {
+                batch->batch[i] = new_task(urls[h][b + i * num_batches], 0, WHOLE_FILE);
+            }
+
+            while (submitted - __atomic_load_n(&context->batches_taken, __ATOMIC_ACQUIRE)
+                >= context->num_workers * 2) {
+                wait_tasks(download_dir, context, 1);
+                --outstanding;
+            }
+            submit_task(context, batch);
+            ++submitted;
+            outstanding += size;
+        }
+    }
+
+    //Step3: collect the rest
+    wait_tasks(download_dir, context, outstanding);
+    for (int h = 0; h < num_hosts; ++h) {
+        for (int i = 0; i < counts[h]; ++i) {
+            free(urls[h][i]);
+        }
+
+        free(urls[h]);
+        free(hosts[h]);
+    }
+
+    free(hosts);
+    free(urls);
+    free(counts);
+    free(line);
+}
+
+
+/**
+ * Download a file of known size in num_tasks chunks with the io_uring
+ * engine, writing each chunk straight into the final file from the main
+ * thread, so no chunk files or merge are needed
+ * @param url - The url of the file
+ * @param download_dir - The directory to write the file into
+ * @param num_tasks - The number of chunks
+ * @param bytes - The max chunk size
+ * @param syscalls - Incremented by the system calls made
+ * @return int - 0 on success, -1 if the download failed and left no file
+ */
+int download_uring(char *url, const char *download_dir, int num_tasks, long bytes, long *syscalls) {
+    char write_file_path[FILE_SIZE];
+    long *min_ranges = malloc(sizeof(long) * num_tasks);
+    long *max_ranges = malloc(sizeof(long) * num_tasks);
+
+    //A single chunk is the whole file
+    long expected = num_tasks > 1 ? 0 : get_content_size();
+    for (int i = 0; i < num_tasks; ++i) {
+        min_ranges[i] = i * bytes;
+        max_ranges[i] = num_tasks > 1 ? chunk_max_range(i, num_tasks, bytes) : -1;
+        if (num_tasks > 1) {
+            expected += max_ranges[i] - min_ranges[i] + 1;
+        }
+    }
+
+    long written = -1;
+    if (url_file_path(write_file_path, download_dir, url) == 0) {
+        written = uring_download(url, write_file_path, min_ranges, max_ranges, num_tasks, syscalls);
+        if (written >= 0 && written != expected) {
+            fprintf(stderr, "wrote %ld of %ld bytes to: %s\n", written, expected, write_file_path);
+            written = -1;
+        }
+        if (written < 0) {
+            unlink(write_file_path);
+            count_file_syscalls(1);
+        }
+    }
+    if (written < 0) {
+        fprintf(stderr, "error downloading: %s\n", url);
+    }
+    else {
+        bytes_downloaded += written;
+        printf("downloaded %ld bytes from %s\n", written, url);
+    }
+
+    free(min_ranges);
+    free(max_ranges);
+    return written < 0 ? -1 : 0;
+}
+
+
+/**
+ * Download a file of known size in num_tasks chunks straight into the
+ * preallocated final file, so there is no Buffer, chunk file or merge.
+ * With SINK_MMAP each worker receives its range directly into a shared
+ * mapping of the file, otherwise it streams the range through a pooled
+ * aligned segment and writes it at the chunk's offset. The file is
+ * flushed once it completes.
+ * @param url - The url of the file
+ * @param download_dir - The directory to write the file into
+ * @param context - The worker context
+ * @param num_tasks - The number of chunks
+ * @param bytes - The max chunk size
+ * @param mode - How the sink writes e.g. SINK_MMAP or SINK_DIRECT
+ * @return int - 0 on success, -1 if a chunk failed and the file was removed
+ */
+int download_to_sink(char *url, const char *download_dir, Context *context,
+    int num_tasks, long bytes, int mode) {
+    char write_file_path[FILE_SIZE];
+    long size = get_content_size();
+    int failures = context->failures;
+
+    if (url_file_path(write_file_path, download_dir, url) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    Sink *sink = sink_open(write_file_path, size, mode);
+    if (sink == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    //Chunks overlap the next by a byte, so each keeps only its own bytes
+    void **tasks = (void**)malloc(sizeof(void*) * num_tasks);
+    for (int i = 0; i < num_tasks; ++i) {
+        Task *task = new_task(url, i * bytes, chunk_max_range(i, num_tasks, bytes));
+        if (mode == SINK_MMAP) {
+            task->dest = sink_region(sink, task->min_range);
+        }
+        else {
+            task->sink = sink;
+        }
+        task->limit = i < num_tasks - 1 ? bytes : size - task->min_range;
+        tasks[i] = task;
+    }
+    submit_tasks(context, tasks, num_tasks);
+    free(tasks);
+
+    wait_tasks(download_dir, context, num_tasks);
+
+    int rc = sink_close(sink);
+    if (rc != 0) {
+        fprintf(stderr, "error writing to: %s\n", write_file_path);
+    }
+
+    //The file was preallocated, so a failed chunk leaves a hole in it
+    if (rc != 0 || context->failures != failures) {
+        unlink(write_file_path);
+        count_file_syscalls(1);
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * Print how many system calls the download took per GB
+ * @param engine - The name of the engine used
+ * @param syscalls - The system calls made
+ */
+void print_syscall_report(const char *engine, long syscalls) {
+    double gb = bytes_downloaded / (1024.0 * 1024.0 * 1024.0);
+
+    printf(">>%s engine: %ld system calls for %ld bytes (%.0f per GB)\n",
+        engine, syscalls, bytes_downloaded, gb > 0 ? syscalls / gb : 0);
+}
+
+
+/**
+ * Parse a byte count with an optional K, M or G suffix e.g. 64M
+ * @param text - The text to parse
+ * @return long - The number of bytes
+ */
+long parse_size(const char *text) {
+    char *suffix;
+    long size = strtol(text, &suffix, 10);
+
+    switch (*suffix) {
+    case 'G': case 'g':
+        size <<= 10;
+        /* fall through */
+    case 'M': case 'm':
+        size <<= 10;
+        /* fall through */
+    case 'K': case 'k':
+        size <<= 10;
+        break;
+    default:
+        break;
+    }
+    return size;
+}
+
+
+void usage(void) {
+    fprintf(stderr, "usage: ./downloader [-p depth] [-s] [-m ranges] [-u bytes] [-e engine] [-o sink] [-w writers] [-b bytes] [-a bytes] [-q] url_file num_workers download_dir\n");
+    fprintf(stderr, "  -p depth   pipeline each file's chunks over one connection\n");
+    fprintf(stderr, "  -s         small files: fetch whole files per host over shared connections\n");
+    fprintf(stderr, "  -m ranges  ask for this many disjoint ranges per request\n");
+    fprintf(stderr, "  -u bytes   range size used when a file's length is unknown\n");
+    fprintf(stderr, "  -e engine  thread (default) or uring: one thread drives all chunks with io_uring\n");
+    fprintf(stderr, "  -o sink    chunks (default): temp files then merge, or write into the final file by\n");
+    fprintf(stderr, "             mmap: receiving into its mapping, buffered: pwrite, direct: O_DIRECT pwrite\n");
+    fprintf(stderr, "  -w writers writer threads which write completed chunks into the final file with\n");
+    fprintf(stderr, "             pwritev instead of the main thread writing chunk files to merge\n");
+    fprintf(stderr, "  -b bytes   memory budget for received chunks held at once, e.g. 64M; tasks wait\n");
+    fprintf(stderr, "             to start while it is used up\n");
+    fprintf(stderr, "  -a bytes   put files up to this size together in memory and write them at once,\n");
+    fprintf(stderr, "             0 never; by default a segment per worker, within half the budget\n");
+    fprintf(stderr, "  -q         count puts, gets, blocked time and depth of the queues and print them\n");
+    exit(1);
+}
+
+
+/*
+ * A url whose chunk files are ready to be merged
+ */
+typedef struct {
+    char *url;
+    char *dir;
+    int job;                //Index of the url, naming its chunk files
+    long bytes;
+    int num_tasks;
+} MergeJob;
+
+
+/**
+ * Merge thread: merges the chunk files of each job and removes them, so
+ * the next url downloads while the last one is still being merged.
+ * A NULL job stops the thread.
+ * @param arg - The queue of merge jobs
+ * @return void* - The number of urls which failed to merge, as an intptr_t
+ */
+void *merge_thread(void *arg) {
+    Queue *merges = (Queue*)arg;
+    MergeJob *job;
+    intptr_t failed = 0;
+
+    while ((job = (MergeJob*)queue_get(merges)) != NULL) {
+        int rc = merge_files(job->dir, job->url, job->job, job->bytes, job->num_tasks);
+        if (remove_chunk_files(job->dir, job->url, job->job, job->bytes, job->num_tasks) != 0 || rc != 0) {
+            fprintf(stderr, ">>failed to download %s\n", job->url);
+            ++failed;
         }
+        free(job->url);
+        free(job);
     }
-    printf(">>Remove chunk file successfully\n");
+    return (void*)failed;
 }
 
 
 int main(int argc, char **argv) {
-    if (argc != 4) {
-        fprintf(stderr, "usage: ./downloader url_file num_workers download_dir\n");
-        exit(1);
+    int opt, pipeline_depth = 0, small_files = 0, multi_ranges = 0;
+    int use_uring = 0, sink_mode = -1, num_writers = 0, queue_stats = 0;
+    long uring_syscalls = 0, budget = 0, assemble = -1, open_chunk_size = OPEN_CHUNK_SIZE;
+
+    while ((opt = getopt(argc, argv, "p:sm:u:e:o:w:b:a:q")) != -1) {
+        switch (opt) {
+        case 'p':
+            pipeline_depth = atoi(optarg);
+            break;
+        case 's':
+            small_files = 1;
+            break;
+        case 'm':
+            multi_ranges = atoi(optarg);
+            break;
+        case 'u':
+            open_chunk_size = parse_size(optarg);
+            break;
+        case 'e':
+            if (strcmp(optarg, "uring") == 0) {
+                use_uring = 1;
+            }
+            else if (strcmp(optarg, "thread") != 0) {
+                usage();
+            }
+            break;
+        case 'o':
+            if (strcmp(optarg, "mmap") == 0) {
+                sink_mode = SINK_MMAP;
+            }
+            else if (strcmp(optarg, "buffered") == 0) {
+                sink_mode = SINK_BUFFERED;
+            }
+            else if (strcmp(optarg, "direct") == 0) {
+                sink_mode = SINK_DIRECT;
+            }
+            else if (strcmp(optarg, "chunks") != 0) {
+                usage();
+            }
+            break;
+        case 'w':
+            num_writers = atoi(optarg);
+            break;
+        case 'b':
+            budget = parse_size(optarg);
+            break;
+        case 'a':
+            assemble = parse_size(optarg);
+            break;
+        case 'q':
+            queue_stats = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (argc - optind != 3) {
+        usage();
     }
 
-    char *url_file = argv[1];
-    int num_workers = atoi(argv[2]);
-    char *download_dir = argv[3];
+    char *url_file = argv[optind];
+    int num_workers = atoi(argv[optind + 1]);
+    char *download_dir = argv[optind + 2];
+
+    assemble = assembly_threshold(assemble, num_workers, budget);
 
     create_directory(download_dir);
     FILE *fp = fopen(url_file, "r");
@@ -287,43 +2280,184 @@ int main(int argc, char **argv) {
     }
 
     // spawn threads and create work queue(s)
-    Context *context = spawn_workers(num_workers);
+    Context *context = spawn_workers(num_workers, pipeline_depth, num_writers, budget, queue_stats);
 
-    int work = 0, bytes = 0, num_tasks = 0;
+    pthread_t merger;
+    Queue *merges = queue_alloc(MERGE_BACKLOG);
+    pthread_create(&merger, NULL, merge_thread, merges);
+
+    //Each small file is a single task, so its failures count urls
+    int work = 0, num_tasks = 0, failed = 0;
+    if (small_files) {
+        download_small_files(fp, download_dir, context);
+        failed += context->failures;
+    }
+
+    long bytes = 0;
     while ((len = getline(&line, &len, fp)) != -1) {
 
         if (line[len - 1] == '\n') {
             line[len - 1] = '\0';
         }
+        ++context->job;
 
-        num_tasks = get_num_tasks(line, num_workers);
+        //Multi-range requests split the file finer than the connections
+        if (multi_ranges > 0) {
+            num_tasks = get_num_tasks(line, num_workers * multi_ranges);
+        }
+        else {
+            num_tasks = get_num_tasks(line, num_workers);
+        }
+        if (num_tasks < 0) {
+            ++failed;
+            continue;
+        }
         bytes = get_max_chunk_size();
         
-        for (int i  = 0; i < num_tasks; i ++) {
-            ++work;
-            queue_put(context->todo, new_task(line, i * bytes, (i+1) * bytes));
+        if (use_uring && num_tasks > 0 && get_content_size() > 0) {
+            //Chunks go straight into the final file, nothing to merge
+            if (download_uring(line, download_dir, num_tasks, bytes, &uring_syscalls) != 0) {
+                ++failed;
+            }
+            continue;
+        }
+
+        if (sink_mode >= 0 && num_tasks > 0 && get_content_size() > 0
+            && multi_ranges == 0 && pipeline_depth == 0) {
+            if (download_to_sink(line, download_dir, context, num_tasks, bytes, sink_mode) != 0) {
+                fprintf(stderr, ">>failed to download %s\n", line);
+                ++failed;
+            }
+            continue;
+        }
+
+        //Small files skip the chunk files altogether, if there is memory for them
+        int failures = context->failures;
+        int assembled = num_tasks > 0 && get_content_size() > 0
+            && get_content_size() <= assemble && open_assembly(context, get_content_size()) == 0;
+        if (!assembled && num_writers > 0) {
+            open_output(context, download_dir, line);
+        }
+
+        if (num_tasks == 0) {
+            //Length unknown but ranges accepted, find it while downloading
+            bytes = open_chunk_size;
+            plan_results(context, bytes);
+            num_tasks = download_open_ended(line, download_dir, context, bytes);
+            if (num_tasks < 0) {
+                fprintf(stderr, ">>failed to download %s\n", line);
+                discard_url(context, download_dir, line, bytes, 0);
+                ++failed;
+                continue;
+            }
+        }
+        else if (multi_ranges > 0) {
+            //Chunk i goes to request i % num_batches, so ranges are disjoint
+            int num_batches = num_tasks < num_workers ? num_tasks : num_workers;
+            expect_tasks(context, num_tasks);
+            for (int b = 0; b < num_batches; ++b) {
+                int size = num_tasks / num_batches + (b < num_tasks % num_batches);
+                Task *batch = new_batch(line, size);
+                batch->multi_range = 1;
+
+                for (int i = 0; i < size; ++i) {
+                    int chunk = b + i * num_batches;
+                    ++work;
+                    batch->batch[i] = new_task(line, chunk * bytes,
+                        chunk_max_range(chunk, num_tasks, bytes));
+                }
+                submit_task(context, batch);
+            }
+        }
+        else if (pipeline_depth > 0) {
+            //All chunks go back-to-back over a single connection
+            Task *batch = new_batch(line, num_tasks);
+            expect_tasks(context, num_tasks);
+            for (int i  = 0; i < num_tasks; i ++) {
+                ++work;
+                batch->batch[i] = new_task(line, i * bytes, chunk_max_range(i, num_tasks, bytes));
+            }
+            submit_task(context, batch);
+        }
+        else {
+            //Chunks overlap the next by a byte, the last holds the remainder
+            long last = get_content_size() - (num_tasks - 1) * bytes;
+            if (get_content_size() > 0) {
+                plan_results(context, num_tasks > 1 && bytes + 1 > last ? bytes + 1 : last);
+            }
+
+            //Hand all chunks over in one go, the workers wake as they fit
+            void **tasks = (void**)malloc(sizeof(void*) * num_tasks);
+            expect_tasks(context, num_tasks);
+            for (int i  = 0; i < num_tasks; i ++) {
+                ++work;
+                tasks[i] = new_task(line, i * bytes, chunk_max_range(i, num_tasks, bytes));
+            }
+            submit_tasks(context, tasks, num_tasks);
+            free(tasks);
         }
       
         // Get results back
-        while (work > 0) {
-            --work;
-            wait_task(download_dir, context);
+        wait_tasks(download_dir, context, work);
+        work = 0;
+
+        //A failed chunk leaves a hole, so keep nothing of the url
+        if (context->failures != failures) {
+            fprintf(stderr, ">>failed to download %s\n", line);
+            discard_url(context, download_dir, line, bytes, num_tasks);
+            ++failed;
+            continue;
         }
         
-        /* Merge the files -- simple synchronous method
-         * Then remove the chunked download files
-         * Beware, this is not an efficient method
-         */
-        merge_files(download_dir, line, bytes, num_tasks);
-        remove_chunk_files(download_dir, bytes, num_tasks);
+        if (context->assembly) {
+            close_assembly(context, download_dir, line);
+            continue;
+        }
+
+        //The writers already put every chunk in place
+        if (context->output) {
+            close_output(context);
+            continue;
+        }
+
+        //Merge the files and remove the chunks while the next url downloads
+        MergeJob *job = (MergeJob*)malloc(sizeof(MergeJob));
+        job->url = strdup(line);
+        job->dir = download_dir;
+        job->job = context->job;
+        job->bytes = bytes;
+        job->num_tasks = num_tasks;
+        queue_put(merges, job);
     }
-   
+
+    //The merge thread reports the urls it failed on once it stops
+    void *merge_failed;
+    queue_put(merges, NULL);
+    pthread_join(merger, &merge_failed);
+    queue_free(merges);
+    failed += (intptr_t)merge_failed;
 
     //cleanup
     fclose(fp);
     free(line);
 
+    if (budget > 0) {
+        printf(">>peak buffered: %ld bytes of a %ld byte budget\n", budget_peak(context->budget), budget);
+    }
+    else {
+        printf(">>peak buffered: %ld bytes\n", budget_peak(context->budget));
+    }
+    long hits, misses;
+    pool_stats(context->results, &hits, &misses);
+    if (hits + misses > 0) {
+        printf(">>result pool: %.0f%% hit rate (%ld of %ld), %ld bytes resident\n",
+            100.0 * hits / (hits + misses), hits, hits + misses, pool_resident(context->results));
+    }
     free_workers(context);
 
-    return 0;
+    //Files the io_uring engine could not take went through the threads
+    long thread_syscalls = http_get_syscalls() + file_syscalls;
+    print_syscall_report(use_uring ? "uring" : "thread", uring_syscalls + thread_syscalls);
+
+    return failed > 0 ? EXIT_FAILURE : 0;
 }
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -6,12 +8,38 @@
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 
 #include "http.h"
 
 #define BUF_SIZE 1024
-#define GET "getter"
-#define HEAD "header"
+#define MAX_CHUNK_DIGITS 15 //Hex digits of the largest chunk size accepted
+long max_chunk_size;
+long content_size;
+long http_syscalls;
+
+//Count system calls made on the download path, from any thread
+#define count_syscalls(n) __atomic_add_fetch(&http_syscalls, (n), __ATOMIC_RELAXED)
+
+// A response body being read from its connection piece by piece
+typedef struct HttpStreamStruct {
+    int sockfd;
+    char header[BUFSIZ];
+    size_t pending_start;   //Body bytes which arrived with the header
+    size_t pending_end;
+    int chunked;            //The body is decoded as it is read
+    ChunkDecoder decoder;
+} HttpStream;
+
+// A persistent connection and the bytes read from it which do not
+// belong to a response handed out yet
+typedef struct {
+    int sockfd;
+    Buffer pending;
+    size_t capacity;
+} Connection;
 
 /**
  * Create Client Socket by TCP
@@ -40,6 +68,7 @@ int client_socket(char *host_name, int server_port){
 
     //Connect socket to server
     int rc = connect(client_sockfd, server_info->ai_addr, server_info->ai_addrlen);
+    count_syscalls(2);
     if(rc == -1){
         perror(">>Connection error with server\n");
         exit(1);
@@ -55,9 +84,27 @@ int client_socket(char *host_name, int server_port){
  * @param range - Byte range e.g. 0-500. NOTE: A server may not respect this
  */
 char* pack_http_request(char* host, char* page, const char* range, const char* method){
-    char *http_request_packet = (char*)malloc(1024);
+    //Room for the fixed request text plus the variable fields
+    size_t size = 1024 + strlen(host) + strlen(page) + (range ? strlen(range) : 0);
+    char *http_request_packet = (char*)malloc(size);
+
+    format_http_request(http_request_packet, host, page, range, method);
+
+    return http_request_packet;
+}
 
-    memset(http_request_packet, 0, 1024);
+
+/**
+ * Write an Http Request Packet into memory supplied by the caller, which
+ * has room for 1024 bytes plus the lengths of the fields
+ * @param http_request_packet - Where the request is written
+ * @param host_name - The host name e.g. www.canterbury.ac.nz
+ * @param page - e.g. /index.html
+ * @param range - Byte range e.g. 0-500. NOTE: A server may not respect this
+ */
+void format_http_request(char *http_request_packet, char* host, char* page,
+    const char* range, const char* method){
+    http_request_packet[0] = '\0';
 
     //Pack http request together from following
 
@@ -69,7 +116,15 @@ char* pack_http_request(char* host, char* page, const char* range, const char* m
     }
 
     strcat(http_request_packet, page);
-    strcat(http_request_packet, " HTTP/1.0\r\n");
+
+    //HTTP 1.1, so servers may send chunked bodies, but only pipelined
+    //requests keep the connection open
+    strcat(http_request_packet, " HTTP/1.1\r\n");
+    if (strcmp(method, KEEP_ALIVE) == 0){
+        strcat(http_request_packet, "Connection: keep-alive\r\n");
+    }else{
+        strcat(http_request_packet, "Connection: close\r\n");
+    }
     strcat(http_request_packet, "Host: ");
     strcat(http_request_packet, host);
     strcat(http_request_packet, "\r\n");
@@ -84,8 +139,6 @@ char* pack_http_request(char* host, char* page, const char* range, const char* m
     strcat(http_request_packet, "User-Agent: ");
     strcat(http_request_packet, "getter");
     strcat(http_request_packet, "\r\n\r\n");
-
-    return http_request_packet;
 }
 
 /**
@@ -94,7 +147,9 @@ char* pack_http_request(char* host, char* page, const char* range, const char* m
  * @param http_request
  */
 int send_http_request(int client_sockfd, char* http_request){
-    int result = write(client_sockfd, http_request, strlen(http_request));
+    //MSG_NOSIGNAL so a server which already closed does not kill us by SIGPIPE
+    int result = send(client_sockfd, http_request, strlen(http_request), MSG_NOSIGNAL);
+    count_syscalls(1);
     if(result < 0){
         printf(">>Send http request error!\n");
         exit(1);
@@ -104,9 +159,187 @@ int send_http_request(int client_sockfd, char* http_request){
 }
 
 /**
- * Perform an HTTP 1.0 query to a given host and page and port number.
+ * Find the value of a header field (case insensitive) in a header block
+ * @param header - Start of the HTTP header block
+ * @param length - Length of the header block
+ * @param name - Field name e.g. Content-Length
+ * @return pointer to the first character of the value or NULL if missing
+ */
+static const char *find_header(const char *header, size_t length, const char *name){
+    size_t name_length = strlen(name);
+    const char *line = header;
+    const char *end = header + length;
+
+    while (line < end) {
+        const char *line_end = memmem(line, end - line, "\r\n", 2);
+        if (line_end == NULL) {
+            line_end = end;
+        }
+
+        if (line_end - line > name_length && line[name_length] == ':'
+            && strncasecmp(line, name, name_length) == 0) {
+            const char *value = line + name_length + 1;
+            while (value < line_end && (*value == ' ' || *value == '\t')) {
+                ++value;
+            }
+            return value;
+        }
+        line = line_end + 2;
+    }
+    return NULL;
+}
+
+/**
+ * Check whether a response header block announces a chunked body
+ * @param header - Start of the HTTP header block
+ * @param length - Length of the header block
+ * @return int - 1 if the body uses chunked Transfer-Encoding
+ */
+static int is_chunked(const char *header, size_t length){
+    const char *encoding = find_header(header, length, "Transfer-Encoding");
+    return encoding && strncasecmp(encoding, "chunked", 7) == 0;
+}
+
+// Where a chunked body is decoded to, in place
+typedef struct {
+    char *memory;
+    size_t length;
+} InPlace;
+
+/**
+ * Sink which moves decoded bytes down to the end of the decoded part of
+ * the same memory. Decoded bytes never pass the raw bytes they come
+ * from, so the move is always backwards.
+ * @param arg - The InPlace being decoded into
+ */
+static int move_in_place(void *arg, const char *data, size_t length){
+    InPlace *in_place = (InPlace*)arg;
+
+    memmove(in_place->memory + in_place->length, data, length);
+    in_place->length += length;
+
+    return 0;
+}
+
+
+/**
+ * Prepare a decoder for the start of a chunked body
+ * @param decoder - The decoder to reset
+ */
+void chunk_decoder_init(ChunkDecoder *decoder) {
+    decoder->state = CHUNK_SIZE;
+    decoder->remaining = 0;
+    decoder->digits = 0;
+}
+
+
+/**
+ * Decode the next bytes of a chunked body. Chunk sizes and framing are
+ * parsed in place and each run of payload bytes is handed to the sink
+ * directly from data, so payload is never copied by the decoder.
+ * @param decoder - Decoder state carried between calls
+ * @param data - The next bytes of the body as received
+ * @param length - The number of bytes in data
+ * @param sink - Called with each run of decoded payload bytes
+ * @param arg - Passed to the sink
+ * @return size_t - The bytes of data consumed. Less than length only once
+ *                  the body is complete (or malformed), when the rest
+ *                  belongs to whatever follows the body.
+ */
+size_t chunk_decode(ChunkDecoder *decoder, const char *data, size_t length,
+    http_sink sink, void *arg) {
+    size_t i = 0;
+
+    while (i < length && decoder->state != CHUNK_DONE && decoder->state != CHUNK_ERROR) {
+        char c = data[i];
+
+        switch (decoder->state) {
+        case CHUNK_SIZE:
+            //Hex digits of the size, then extensions up to the line end
+            if (isxdigit((unsigned char)c)) {
+                //A longer size would overflow, no sane chunk is that big
+                if (decoder->digits == MAX_CHUNK_DIGITS) {
+                    decoder->state = CHUNK_ERROR;
+                    break;
+                }
+                int digit = isdigit((unsigned char)c) ? c - '0' : (tolower(c) - 'a' + 10);
+                decoder->remaining = decoder->remaining * 16 + digit;
+                ++decoder->digits;
+            }else if (decoder->digits == 0) {
+                decoder->state = CHUNK_ERROR;
+                break;
+            }else {
+                decoder->state = CHUNK_SIZE_LINE;
+                continue;
+            }
+            ++i;
+            break;
+
+        case CHUNK_SIZE_LINE:
+            if (c == '\n') {
+                decoder->state = decoder->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+            }
+            ++i;
+            break;
+
+        case CHUNK_DATA: {
+            //Hand the payload straight to the sink
+            size_t run = length - i < decoder->remaining ? length - i : decoder->remaining;
+            if (sink(arg, data + i, run) != 0) {
+                decoder->state = CHUNK_ERROR;
+                break;
+            }
+            i += run;
+            decoder->remaining -= run;
+            if (decoder->remaining == 0) {
+                decoder->state = CHUNK_DATA_END;
+            }
+            break;
+        }
+
+        case CHUNK_DATA_END:
+            //CRLF after the payload, then the next size line
+            if (c == '\n') {
+                decoder->state = CHUNK_SIZE;
+                decoder->digits = 0;
+            }else if (c != '\r') {
+                decoder->state = CHUNK_ERROR;
+                break;
+            }
+            ++i;
+            break;
+
+        case CHUNK_TRAILER:
+            //An empty line ends the trailer and the body
+            if (c == '\n') {
+                decoder->state = CHUNK_DONE;
+            }else if (c != '\r') {
+                decoder->state = CHUNK_TRAILER_LINE;
+            }
+            ++i;
+            break;
+
+        case CHUNK_TRAILER_LINE:
+            if (c == '\n') {
+                decoder->state = CHUNK_TRAILER;
+            }
+            ++i;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    return i;
+}
+
+
+/**
+ * Perform an HTTP 1.1 query to a given host and page and port number.
  * host is a hostname and page is a path on the remote server. The query
  * will attempt to retrievev content in the given byte range.
+ * A chunked body is decoded, so the returned content is the payload.
  * User is responsible for freeing the memory.
  * 
  * @param host - The host name e.g. www.canterbury.ac.nz
@@ -117,10 +350,27 @@ int send_http_request(int client_sockfd, char* http_request){
  *                  NULL is returned on failure.
  */
 Buffer* http_query(char *host, char *page, const char *range, int port) {
-    // assert(0 && "not implemented yet!");
+    return http_query_limit(host, page, range, port, 0);
+}
 
+
+/**
+ * Perform an HTTP 1.1 query like http_query, but stop reading once the
+ * body holds max_body bytes and close the connection, cancelling the
+ * rest of the transfer. Useful with open-ended ranges e.g. 500-
+ * 
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param page - e.g. /index.html
+ * @param range - Byte range e.g. 0-500. NOTE: A server may not respect this
+ * @param port - e.g. 80
+ * @param max_body - The most body bytes to keep, 0 for no limit
+ * @return Buffer - Pointer to a buffer holding response data from query
+ *                  NULL is returned on failure, or for a chunked body
+ *                  which is malformed or ends before its last chunk.
+ */
+Buffer* http_query_limit(char *host, char *page, const char *range, int port, size_t max_body) {
     Buffer *response;
-    int read_count;
+    long read_count;
     char *http_request;
 
     //Step1: Setup Socket TCP connection
@@ -130,32 +380,389 @@ Buffer* http_query(char *host, char *page, const char *range, int port) {
     http_request = pack_http_request(host, page, range, GET);
     send_http_request(client_sockfd, http_request);
 
-    //Step3: get response from server
+    //Step3: get response from server, reading straight into the response
+    //which grows geometrically, so the body is never copied
+    size_t capacity = BUFSIZ;
     response = (Buffer*)malloc(sizeof(Buffer));
-    response->data = (char *)malloc(sizeof(char) * BUFSIZ);
-    memset(response->data, 0, BUFSIZ);
-    response->length = 0;
+    response->data = (char *)malloc(capacity);
 
-    //Define pointer to store read data
-    char *new_read_data = malloc(BUFSIZ);
+    //Once the header shows a chunked body, decode it in place as it arrives
+    ChunkDecoder decoder;
+    InPlace in_place = { response->data, 0 };
+    int chunked = 0, limited = 0;
+    size_t header_length = 0;
 
-    read_count = 0;
-    while((read_count = read(client_sockfd, new_read_data, BUFSIZ)) > 0){
-        response->length = response->length + read_count;
-        response->data = realloc(response->data, response->length);
-        //copy data to  the end of response->data (!!response->data is the starting position for char[])
-        memcpy(response->data + response->length - read_count, new_read_data, read_count);
+    while (!(chunked && (decoder.state == CHUNK_DONE || decoder.state == CHUNK_ERROR))) {
+        if (in_place.length + BUFSIZ + 1 > capacity) {
+            capacity *= 2;
+            response->data = realloc(response->data, capacity);
+            in_place.memory = response->data;
+        }
 
+        read_count = read(client_sockfd, response->data + in_place.length, capacity - 1 - in_place.length);
+        if (read_count <= 0) {
+            break;
+        }
+        count_syscalls(1);
+
+        if (chunked) {
+            chunk_decode(&decoder, response->data + in_place.length, read_count, move_in_place, &in_place);
+        }
+        else {
+            in_place.length += read_count;
+        }
+
+        char *header_end = header_length ? NULL : memmem(response->data, in_place.length, "\r\n\r\n", 4);
+        if (header_end) {
+            header_length = header_end + 4 - response->data;
+            chunked = is_chunked(response->data, header_length);
+
+            //Decode the body bytes which came in with the header
+            if (chunked) {
+                size_t body_length = in_place.length - header_length;
+                in_place.length = header_length;
+
+                chunk_decoder_init(&decoder);
+                chunk_decode(&decoder, response->data + header_length, body_length, move_in_place, &in_place);
+            }
+        }
+
+        //Drop whatever is past the limit and stop the transfer
+        if (max_body > 0 && header_length > 0 && in_place.length - header_length >= max_body) {
+            in_place.length = header_length + max_body;
+            limited = 1;
+            break;
+        }
     }
 
+    response->length = in_place.length;
+    response->data[response->length] = '\0';
+
+    //The read which saw EOF and the close
     close(client_sockfd);
+    count_syscalls(2);
     free(http_request);
-    free(new_read_data);
+
+    //A chunked body cut short by anything but the limit is incomplete
+    if (chunked && !limited && decoder.state != CHUNK_DONE) {
+        buffer_free(response);
+        return NULL;
+    }
 
     return response;
 }
 
 
+// Where http_query_into puts decoded chunked bytes
+typedef struct {
+    char *dest;
+    size_t capacity;
+    size_t received;
+} Region;
+
+/**
+ * Sink which copies decoded bytes into a fixed region, dropping any
+ * which do not fit
+ * @param arg - The Region to fill
+ */
+static int copy_to_region(void *arg, const char *data, size_t length){
+    Region *region = (Region*)arg;
+    size_t room = region->capacity - region->received;
+
+    memcpy(region->dest + region->received, data, length < room ? length : room);
+    region->received += length < room ? length : room;
+
+    return 0;
+}
+
+
+/**
+ * Perform an HTTP 1.1 query like http_query, but receive the body
+ * directly into memory supplied by the caller instead of a Buffer.
+ * Only the header (and any body bytes arriving with it) pass through a
+ * scratch buffer. Reading stops once capacity bytes have arrived.
+ * 
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param page - e.g. /index.html
+ * @param range - Byte range e.g. 0-500. NOTE: A server may not respect this
+ * @param port - e.g. 80
+ * @param dest - Where the body is stored
+ * @param capacity - The most body bytes to store
+ * @return long - The body bytes stored, -1 on failure or a status other
+ *                than the one http_status_matches expects
+ */
+long http_query_into(char *host, char *page, const char *range, int port,
+    char *dest, size_t capacity) {
+    char header[BUFSIZ];
+    size_t header_length = 0, length = 0;
+    char *header_end = NULL;
+    long read_count;
+    Region region = { dest, capacity, 0 };
+
+    //Step1: Setup Socket TCP connection and send out http request
+    int client_sockfd = client_socket(host, port);
+    char *http_request = pack_http_request(host, page, range, GET);
+    send_http_request(client_sockfd, http_request);
+    free(http_request);
+
+    //Step2: read until the header ends
+    while (header_end == NULL && length < BUFSIZ - 1) {
+        read_count = read(client_sockfd, header + length, BUFSIZ - 1 - length);
+        count_syscalls(1);
+        if (read_count <= 0) {
+            break;
+        }
+        length += read_count;
+        header[length] = '\0';
+        header_end = memmem(header, length, "\r\n\r\n", 4);
+    }
+
+    Buffer response = { header, length };
+    if (header_end == NULL || !http_status_matches(http_get_status(&response), range)) {
+        close(client_sockfd);
+        count_syscalls(1);
+        return -1;
+    }
+    header_length = header_end + 4 - header;
+
+    //Step3: a chunked body has to be decoded on its way to the region
+    if (is_chunked(header, header_length)) {
+        ChunkDecoder decoder;
+        chunk_decoder_init(&decoder);
+        chunk_decode(&decoder, header + header_length, length - header_length, copy_to_region, &region);
+
+        while (region.received < capacity && decoder.state != CHUNK_DONE
+            && (read_count = read(client_sockfd, header, BUFSIZ)) > 0) {
+            count_syscalls(1);
+            chunk_decode(&decoder, header, read_count, copy_to_region, &region);
+        }
+    }
+    else {
+        copy_to_region(&region, header + header_length, length - header_length);
+
+        //Step4: receive the rest of the body straight into place
+        while (region.received < capacity
+            && (read_count = read(client_sockfd, dest + region.received, capacity - region.received)) > 0) {
+            count_syscalls(1);
+            region.received += read_count;
+        }
+    }
+
+    close(client_sockfd);
+    count_syscalls(1);
+
+    return region.received;
+}
+
+
+/**
+ * Perform an HTTP 1.1 query like http_query_limit, but receive the
+ * whole response into memory supplied by the caller, e.g. a pooled
+ * segment. The request is written into the same memory before the
+ * response overwrites it and a chunked body is decoded in place, so
+ * nothing is allocated and no scratch buffer is copied through.
+ *
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param page - e.g. /index.html
+ * @param range - Byte range e.g. 0-500. NOTE: A server may not respect this
+ * @param port - e.g. 80
+ * @param max_body - The most body bytes to keep, 0 for no limit
+ * @param memory - Where the response is stored, NUL terminated
+ * @param capacity - The size of memory
+ * @param response - Set to the response, its data pointing into memory
+ * @return int - 0 on success, -1 on failure, if the response did not fit
+ *               or if a chunked body is malformed or ends before its last chunk
+ */
+int http_query_buffer(char *host, char *page, const char *range, int port,
+    size_t max_body, char *memory, size_t capacity, Buffer *response) {
+    size_t header_length = 0;
+    long read_count = 0;
+    int chunked = 0, limited = 0;
+    ChunkDecoder decoder;
+    InPlace in_place = { memory, 0 };
+
+    //Step1: Setup Socket TCP connection and send out http request
+    if (capacity < 1024 + strlen(host) + strlen(page) + (range ? strlen(range) : 0)) {
+        return -1;
+    }
+    int client_sockfd = client_socket(host, port);
+    format_http_request(memory, host, page, range, GET);
+    send_http_request(client_sockfd, memory);
+
+    //Step2: read into the memory, decoding once the header shows chunks
+    while (in_place.length < capacity - 1
+        && !(chunked && (decoder.state == CHUNK_DONE || decoder.state == CHUNK_ERROR))
+        && (read_count = read(client_sockfd, memory + in_place.length,
+            capacity - 1 - in_place.length)) > 0) {
+        count_syscalls(1);
+        if (chunked) {
+            chunk_decode(&decoder, memory + in_place.length, read_count, move_in_place, &in_place);
+        }
+        else {
+            in_place.length += read_count;
+        }
+
+        char *header_end = header_length ? NULL : memmem(memory, in_place.length, "\r\n\r\n", 4);
+        if (header_end) {
+            header_length = header_end + 4 - memory;
+            chunked = is_chunked(memory, header_length);
+
+            //Decode the body bytes which came in with the header
+            if (chunked) {
+                size_t body_length = in_place.length - header_length;
+                in_place.length = header_length;
+
+                chunk_decoder_init(&decoder);
+                chunk_decode(&decoder, memory + header_length, body_length, move_in_place, &in_place);
+            }
+        }
+
+        //Drop whatever is past the limit and stop the transfer
+        if (max_body > 0 && header_length > 0 && in_place.length - header_length >= max_body) {
+            in_place.length = header_length + max_body;
+            limited = 1;
+            break;
+        }
+    }
+
+    close(client_sockfd);
+    count_syscalls(2);
+
+    //Full memory with more to come means the response did not fit, and a
+    //chunked body cut short by anything but the limit is incomplete
+    if (header_length == 0 || (read_count < 0 && !limited)
+        || (!limited && chunked && decoder.state != CHUNK_DONE)
+        || (!limited && !chunked && in_place.length == capacity - 1)) {
+        return -1;
+    }
+
+    memory[in_place.length] = '\0';
+    response->data = memory;
+    response->length = in_place.length;
+
+    return 0;
+}
+
+
+/**
+ * Send an HTTP 1.1 GET for a url and read its response header, leaving
+ * the body on the connection to be read with http_stream_read into
+ * memory of the caller's choosing, e.g. aligned or pooled buffers.
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * @param range - The desired byte range of data to retrieve from the page
+ * @return stream - The open stream, NULL on failure or a status other
+ *                  than the one http_status_matches expects
+ */
+HttpStream *http_stream_open(const char *url, const char *range) {
+    char host[BUF_SIZE];
+    char *header_end = NULL;
+    size_t length = 0;
+
+    char *page = http_split_url(url, host, sizeof host);
+    if (page == NULL) {
+        return NULL;
+    }
+
+    HttpStream *stream = (HttpStream*)malloc(sizeof(HttpStream));
+
+    //Step1: Setup Socket TCP connection and send out http request
+    stream->sockfd = client_socket(host, 80);
+    char *http_request = pack_http_request(host, page, range, GET);
+    send_http_request(stream->sockfd, http_request);
+    free(http_request);
+
+    //Step2: read until the header ends
+    while (header_end == NULL && length < BUFSIZ - 1) {
+        int read_count = read(stream->sockfd, stream->header + length, BUFSIZ - 1 - length);
+        count_syscalls(1);
+        if (read_count <= 0) {
+            break;
+        }
+        length += read_count;
+        stream->header[length] = '\0';
+        header_end = memmem(stream->header, length, "\r\n\r\n", 4);
+    }
+
+    Buffer response = { stream->header, length };
+    if (header_end == NULL || !http_status_matches(http_get_status(&response), range)) {
+        http_stream_close(stream);
+        return NULL;
+    }
+
+    stream->pending_start = header_end + 4 - stream->header;
+    stream->pending_end = length;
+    stream->chunked = is_chunked(stream->header, stream->pending_start);
+    chunk_decoder_init(&stream->decoder);
+
+    return stream;
+}
+
+
+/**
+ * Read the next body bytes of a stream. Bytes which arrived with the
+ * header are copied out first, the rest is read straight into dest.
+ * A chunked body is decoded in place in dest.
+ * @param stream - The stream to read from
+ * @param dest - Where to store the bytes
+ * @param length - The most bytes to read
+ * @return long - The bytes read, 0 at the end of the body, -1 on error
+ */
+long http_stream_read(HttpStream *stream, char *dest, size_t length) {
+    size_t pending = stream->pending_end - stream->pending_start;
+
+    if (!stream->chunked) {
+        if (pending > 0) {
+            size_t count = pending < length ? pending : length;
+            memcpy(dest, stream->header + stream->pending_start, count);
+            stream->pending_start += count;
+            return count;
+        }
+
+        long read_count = read(stream->sockfd, dest, length);
+        count_syscalls(1);
+        return read_count;
+    }
+
+    //A chunked body decodes to no more bytes than it was sent in, so
+    //decoding at most length raw bytes at a time always fits in dest
+    InPlace in_place = { dest, 0 };
+    while (in_place.length == 0 && stream->decoder.state != CHUNK_DONE) {
+        if (stream->decoder.state == CHUNK_ERROR) {
+            return -1;
+        }
+
+        if (pending > 0) {
+            size_t count = pending < length ? pending : length;
+            memcpy(dest, stream->header + stream->pending_start, count);
+            stream->pending_start += count;
+            pending -= count;
+            chunk_decode(&stream->decoder, dest, count, move_in_place, &in_place);
+            continue;
+        }
+
+        long read_count = read(stream->sockfd, dest, length);
+        count_syscalls(1);
+        if (read_count <= 0) {
+            return read_count < 0 ? -1 : 0;
+        }
+        chunk_decode(&stream->decoder, dest, read_count, move_in_place, &in_place);
+    }
+
+    return in_place.length;
+}
+
+
+/**
+ * Close a stream's connection and free it
+ * @param stream - The stream to close
+ */
+void http_stream_close(HttpStream *stream) {
+    close(stream->sockfd);
+    count_syscalls(1);
+    free(stream);
+}
+
+
 /**
  * Separate the content from the header of an http request.
  * NOTE: returned string is an offset into the response, so
@@ -177,6 +784,29 @@ char* http_get_content(Buffer *response) {
 }
 
 
+/**
+ * Split a url into its host and page, e.g. learn.canterbury.ac.nz/profile
+ * into learn.canterbury.ac.nz and profile. Both are copied into host.
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * @param host - Receives the host, followed by the page
+ * @param size - The size of host in bytes
+ * @return char* - The page, inside host, or NULL if the url has no page
+ */
+char *http_split_url(const char *url, char *host, size_t size) {
+    strncpy(host, url, size - 1);
+    host[size - 1] = '\0';
+
+    char *page = strstr(host, "/");
+    if (page == NULL) {
+        fprintf(stderr, "could not split url into host/page %s\n", url);
+        return NULL;
+    }
+
+    *page++ = '\0';
+    return page;
+}
+
+
 /**
  * Splits an HTTP url into host, page. On success, calls http_query
  * to execute the query against the url. 
@@ -185,50 +815,671 @@ char* http_get_content(Buffer *response) {
  * @return Buffer pointer holding raw string data or NULL on failure
  */
 Buffer *http_url(const char *url, const char *range) {
+    return http_url_limit(url, range, 0);
+}
+
+
+/**
+ * Splits an HTTP url into host, page. On success, calls http_query_limit
+ * to execute the query against the url, keeping at most max_body bytes.
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * @param range - The desired byte range of data to retrieve from the page
+ * @param max_body - The most body bytes to keep, 0 for no limit
+ * @return Buffer pointer holding raw string data or NULL on failure
+ */
+Buffer *http_url_limit(const char *url, const char *range, size_t max_body) {
     char host[BUF_SIZE];
-    strncpy(host, url, BUF_SIZE);
+    char *page = http_split_url(url, host, sizeof host);
 
-    char *page = strstr(host, "/");
-    
-    if (page) {
-        page[0] = '\0';
+    return page ? http_query_limit(host, page, range, 80, max_body) : NULL;
+}
+
+
+/**
+ * Splits an HTTP url into host, page. On success, calls http_query_into
+ * to receive the body directly into dest.
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * @param range - The desired byte range of data to retrieve from the page
+ * @param dest - Where the body is stored
+ * @param capacity - The most body bytes to store
+ * @return long - The body bytes stored, -1 on failure
+ */
+long http_url_into(const char *url, const char *range, char *dest, size_t capacity) {
+    char host[BUF_SIZE];
+    char *page = http_split_url(url, host, sizeof host);
+
+    return page ? http_query_into(host, page, range, 80, dest, capacity) : -1;
+}
+
+/**
+ * Splits an HTTP url into host, page. On success, calls http_query_parts
+ * to stream the parts of the response to a sink.
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * @param range - The desired byte ranges of data to retrieve from the page
+ * @param sink - Called with each run of body bytes and their offset
+ * @param arg - Passed to the sink
+ * @return int - 0 once the whole body was received, -1 on failure
+ */
+int http_url_parts(const char *url, const char *range, http_part_sink sink, void *arg) {
+    char host[BUF_SIZE];
+    char *page = http_split_url(url, host, sizeof host);
+
+    return page ? http_query_parts(host, page, range, 80, sink, arg) : -1;
+}
+
+/**
+ * Splits an HTTP url into host, page. On success, calls http_query_buffer
+ * to receive the response into memory supplied by the caller.
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * @param range - The desired byte range of data to retrieve from the page
+ * @param max_body - The most body bytes to keep, 0 for no limit
+ * @param memory - Where the response is stored
+ * @param capacity - The size of memory
+ * @param response - Set to the response, its data pointing into memory
+ * @return int - 0 on success, -1 on failure or if the response did not fit
+ */
+int http_url_buffer(const char *url, const char *range, size_t max_body,
+    char *memory, size_t capacity, Buffer *response) {
+    char host[BUF_SIZE];
+    char *page = http_split_url(url, host, sizeof host);
+
+    return page ? http_query_buffer(host, page, range, 80, max_body, memory, capacity, response) : -1;
+}
+
+/**
+ * Parse a Content-Range value e.g. "bytes 0-499/1234"
+ * @param value - The field value, may be NULL
+ * @param first - Receives the first byte position
+ * @param last - Receives the last byte position
+ * @param total - Receives the complete length, -1 when given as '*'
+ * @return int - 0 on success, -1 if the value could not be parsed
+ */
+static int parse_content_range(const char *value, long *first, long *last, long *total){
+    char *end;
+
+    if (value == NULL || strncasecmp(value, "bytes ", 6) != 0) {
+        return -1;
+    }
+
+    *first = strtol(value + 6, &end, 10);
+    if (*end != '-') {
+        return -1;
+    }
+    *last = strtol(end + 1, &end, 10);
+    if (*end != '/' || *last < *first) {
+        return -1;
+    }
+    *total = end[1] == '*' ? -1 : strtol(end + 1, NULL, 10);
+
+    return 0;
+}
+
+
+/**
+ * Prepare a parser for a multipart/byteranges body
+ * @param parser - The parser to reset
+ * @param content_type - The Content-Type value of the response
+ * @return int - 0 on success, -1 if the type has no usable boundary
+ */
+int multipart_parser_init(MultipartParser *parser, const char *content_type) {
+    const char *value = content_type ? strcasestr(content_type, "boundary=") : NULL;
+    if (value == NULL) {
+        return -1;
+    }
+    value += 9;
+    if (*value == '"') {
+        ++value;
+    }
+
+    //Delimiter lines are "--" followed by the boundary
+    strcpy(parser->boundary, "--");
+    parser->boundary_length = 2;
+    while (*value && !strchr("\"\r\n; ", *value)) {
+        if (parser->boundary_length == sizeof parser->boundary - 1) {
+            return -1;
+        }
+        parser->boundary[parser->boundary_length++] = *value++;
+    }
+    parser->boundary[parser->boundary_length] = '\0';
+
+    parser->state = PART_BOUNDARY;
+    parser->line_length = 0;
+    parser->has_range = 0;
+    parser->offset = 0;
+    parser->remaining = 0;
+
+    return parser->boundary_length > 2 ? 0 : -1;
+}
+
+
+/**
+ * Act on a complete delimiter or part header line
+ * @param parser - The parser holding the line, without its CRLF
+ */
+static void multipart_line(MultipartParser *parser) {
+    long first, last, total;
+
+    if (parser->state == PART_BOUNDARY) {
+        //Skip the preamble and the CRLF which ends each part
+        if (strncmp(parser->line, parser->boundary, parser->boundary_length) == 0) {
+            if (strncmp(parser->line + parser->boundary_length, "--", 2) == 0) {
+                parser->state = PART_DONE;
+            }else {
+                parser->state = PART_HEADER;
+                parser->has_range = 0;
+            }
+        }
+    }else if (parser->line_length == 0) {
+        //An empty line ends the part header, the part's bytes follow
+        parser->state = parser->has_range ? PART_DATA : PART_ERROR;
+    }else if (strncasecmp(parser->line, "Content-Range:", 14) == 0) {
+        const char *value = parser->line + 14;
+        while (*value == ' ' || *value == '\t') {
+            ++value;
+        }
+        if (parse_content_range(value, &first, &last, &total) != 0) {
+            parser->state = PART_ERROR;
+            return;
+        }
+        parser->offset = first;
+        parser->remaining = last - first + 1;
+        parser->has_range = 1;
+    }
+}
+
+
+/**
+ * Parse the next bytes of a multipart/byteranges body. Delimiters and
+ * part headers are parsed as they arrive and the bytes of each part are
+ * handed to the sink, with their offset from the part's Content-Range,
+ * directly from data.
+ * @param parser - Parser state carried between calls
+ * @param data - The next (decoded) bytes of the body
+ * @param length - The number of bytes in data
+ * @param sink - Called with each run of part bytes
+ * @param arg - Passed to the sink
+ * @return size_t - The bytes of data consumed. Less than length only once
+ *                  the closing delimiter was seen or the body is malformed
+ */
+size_t multipart_parse(MultipartParser *parser, const char *data, size_t length,
+    http_part_sink sink, void *arg) {
+    size_t i = 0;
+
+    while (i < length && parser->state != PART_DONE && parser->state != PART_ERROR) {
+        if (parser->state == PART_DATA) {
+            //Hand the part's bytes straight to the sink
+            size_t run = length - i < parser->remaining ? length - i : parser->remaining;
+            if (sink(arg, parser->offset, data + i, run) != 0) {
+                parser->state = PART_ERROR;
+                break;
+            }
+            i += run;
+            parser->offset += run;
+            parser->remaining -= run;
+            if (parser->remaining == 0) {
+                parser->state = PART_BOUNDARY;
+                parser->line_length = 0;
+            }
+            continue;
+        }
 
-        ++page;
-        return http_query(host, page, range, 80);
+        //Delimiters and part headers are collected a line at a time, only
+        //the start of an overlong line is kept
+        char c = data[i++];
+        if (c != '\n') {
+            if (parser->line_length < sizeof parser->line - 1) {
+                parser->line[parser->line_length++] = c;
+            }
+            continue;
+        }
+        if (parser->line_length > 0 && parser->line[parser->line_length - 1] == '\r') {
+            --parser->line_length;
+        }
+        parser->line[parser->line_length] = '\0';
+        multipart_line(parser);
+        parser->line_length = 0;
+    }
+
+    return i;
+}
+
+
+// Where http_query_parts routes the (decoded) body
+typedef struct {
+    int multipart;
+    MultipartParser parser;
+    long offset;            //Position of the next byte of a single range
+    size_t received;        //Bytes of a single range handed on
+    http_part_sink sink;
+    void *arg;
+} PartStream;
+
+/**
+ * Sink which splits a body into parts or places a single range at its
+ * offset, before handing it on to the caller's part sink
+ * @param arg - The PartStream
+ */
+static int stream_parts(void *arg, const char *data, size_t length){
+    PartStream *stream = (PartStream*)arg;
+
+    if (stream->multipart) {
+        multipart_parse(&stream->parser, data, length, stream->sink, stream->arg);
+        return stream->parser.state == PART_ERROR;
+    }
+
+    if (stream->sink(stream->arg, stream->offset, data, length) != 0) {
+        return -1;
+    }
+    stream->offset += length;
+    stream->received += length;
+
+    return 0;
+}
+
+
+/**
+ * Perform an HTTP 1.1 query for one or more ranges and stream the body
+ * to a sink as it is received, each byte with its position within the
+ * resource. A multipart/byteranges body is split into its parts on the
+ * fly, a single range is placed by its Content-Range and a 200 response
+ * (the server ignored the ranges) starts at offset 0. Nothing is
+ * buffered beyond one read.
+ *
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param page - e.g. /index.html
+ * @param range - Byte ranges e.g. 0-99,200-299
+ * @param port - e.g. 80
+ * @param sink - Called with each run of body bytes
+ * @param arg - Passed to the sink
+ * @return int - 0 once the whole body was received, -1 on failure, an
+ *               error status or if the sink stopped it
+ */
+int http_query_parts(char *host, char *page, const char *range, int port,
+    http_part_sink sink, void *arg) {
+    char data[BUFSIZ];
+    size_t header_length, length = 0;
+    char *header_end = NULL;
+    long read_count = 0, first, last, total, expected = -1, body_length = -1;
+    int failed = 0, done = 0;
+    PartStream stream = { 0, .sink = sink, .arg = arg };
+    ChunkDecoder decoder;
+
+    //Step1: Setup Socket TCP connection and send out http request
+    int client_sockfd = client_socket(host, port);
+    char *http_request = pack_http_request(host, page, range, GET);
+    send_http_request(client_sockfd, http_request);
+    free(http_request);
+
+    //Step2: read until the header ends
+    while (header_end == NULL && length < BUFSIZ - 1) {
+        read_count = read(client_sockfd, data + length, BUFSIZ - 1 - length);
+        count_syscalls(1);
+        if (read_count <= 0) {
+            break;
+        }
+        length += read_count;
+        data[length] = '\0';
+        header_end = memmem(data, length, "\r\n\r\n", 4);
+    }
+
+    Buffer response = { data, length };
+    int status = http_get_status(&response);
+    if (header_end == NULL || (status != 200 && status != 206)) {
+        close(client_sockfd);
+        count_syscalls(1);
+        return -1;
+    }
+    header_length = header_end + 4 - data;
+
+    //Step3: work out where the body goes, a 200 holds everything from 0
+    const char *type = find_header(data, header_length, "Content-Type");
+    const char *content_length = find_header(data, header_length, "Content-Length");
+    int chunked = is_chunked(data, header_length);
+
+    if (content_length && !chunked) {
+        body_length = strtol(content_length, NULL, 10);
+    }
+    if (status == 206 && type && strncasecmp(type, "multipart/byteranges", 20) == 0) {
+        stream.multipart = 1;
+        failed = multipart_parser_init(&stream.parser, type) != 0;
+    }
+    else if (status == 206) {
+        failed = parse_content_range(find_header(data, header_length, "Content-Range"),
+            &first, &last, &total) != 0;
+        stream.offset = first;
+        expected = last - first + 1;
     }
     else {
+        expected = body_length;
+    }
 
-        fprintf(stderr, "could not split url into host/page %s\n", url);
-        return NULL;
+    //Step4: hand each read on as it arrives, the header's leftovers first
+    const char *next = data + header_length;
+    size_t count = length - header_length, consumed = 0;
+    if (chunked) {
+        chunk_decoder_init(&decoder);
+    }
+
+    while (!failed) {
+        if (chunked) {
+            chunk_decode(&decoder, next, count, stream_parts, &stream);
+            failed = decoder.state == CHUNK_ERROR;
+            done = decoder.state == CHUNK_DONE;
+        }
+        else {
+            if (body_length >= 0 && consumed + count > (size_t)body_length) {
+                count = body_length - consumed;
+            }
+            failed = stream_parts(&stream, next, count) != 0;
+            consumed += count;
+            done = body_length >= 0 && consumed == (size_t)body_length;
+        }
+
+        if (failed || done || (stream.multipart && stream.parser.state == PART_DONE)) {
+            break;
+        }
+
+        read_count = read(client_sockfd, data, BUFSIZ);
+        count_syscalls(1);
+        if (read_count <= 0) {
+            break;
+        }
+        next = data;
+        count = read_count;
+    }
+
+    close(client_sockfd);
+    count_syscalls(1);
+
+    //Complete only with every part, or every byte of the single range
+    int complete = stream.multipart ? stream.parser.state == PART_DONE
+        : expected >= 0 ? stream.received == (size_t)expected
+        : !chunked || decoder.state == CHUNK_DONE;
+
+    return failed || read_count < 0 || !complete ? -1 : 0;
+}
+
+
+/**
+ * Read more data from a connection into its pending buffer
+ * @param conn - The connection to read from
+ * @return int - Bytes read, 0 on EOF and -1 on error
+ */
+static int fill_pending(Connection *conn){
+    //Keep room for BUFSIZ more bytes and a terminating '\0'
+    if (conn->pending.length + BUFSIZ + 1 > conn->capacity) {
+        conn->capacity = (conn->pending.length + BUFSIZ + 1) * 2;
+        conn->pending.data = realloc(conn->pending.data, conn->capacity);
+    }
+
+    int read_count = read(conn->sockfd, conn->pending.data + conn->pending.length, BUFSIZ);
+    count_syscalls(1);
+    if (read_count > 0) {
+        conn->pending.length += read_count;
+        conn->pending.data[conn->pending.length] = '\0';
     }
+    return read_count;
 }
 
+/**
+ * Read a chunked body from a connection, decoding it into a response
+ * which holds the header followed by the decoded payload
+ * @param conn - The connection, with the whole header pending
+ * @param header_length - The length of the pending header block
+ * @return Buffer - Header and decoded body, NULL on failure
+ */
+static Buffer *read_chunked_response(Connection *conn, size_t header_length){
+    ChunkDecoder decoder;
+    InPlace in_place = { conn->pending.data, header_length };
+    size_t consumed = header_length;    //Raw bytes decoded so far
+
+    //Decode in place behind the raw bytes, which stay at the end where
+    //fill_pending appends more of them
+    chunk_decoder_init(&decoder);
+
+    while (1) {
+        in_place.memory = conn->pending.data;
+        consumed += chunk_decode(&decoder, conn->pending.data + consumed,
+            conn->pending.length - consumed, move_in_place, &in_place);
+
+        if (decoder.state == CHUNK_DONE) {
+            break;
+        }
+        if (decoder.state == CHUNK_ERROR || fill_pending(conn) <= 0) {
+            return NULL;
+        }
+    }
+
+    //Hand the pending memory over as the response, keeping only the
+    //bytes which follow it
+    Buffer *response = (Buffer*)malloc(sizeof(Buffer));
+    response->data = conn->pending.data;
+    response->length = in_place.length;
+
+    conn->pending.length -= consumed;
+    conn->capacity = conn->pending.length + BUFSIZ + 1;
+    conn->pending.data = malloc(conn->capacity);
+    memcpy(conn->pending.data, response->data + consumed, conn->pending.length);
+    conn->pending.data[conn->pending.length] = '\0';
+    response->data[response->length] = '\0';
+
+    return response;
+}
+
+/**
+ * Read exactly one response from a persistent connection. Bytes which
+ * belong to the next response stay pending on the connection.
+ * @param conn - The connection to read from
+ * @param keep_alive - Set to 0 when the connection can not be reused
+ * @return Buffer - Header and body of the response, NULL on failure
+ */
+static Buffer *read_http_response(Connection *conn, int *keep_alive){
+    char *header_end;
+    *keep_alive = 0;
+
+    //Step1: wait for the whole header block
+    while ((header_end = memmem(conn->pending.data, conn->pending.length, "\r\n\r\n", 4)) == NULL) {
+        if (fill_pending(conn) <= 0) {
+            return NULL;
+        }
+    }
+    size_t header_length = header_end + 4 - conn->pending.data;
+
+    //Step2: find where the body ends
+    const char *content_length = find_header(conn->pending.data, header_length, "Content-Length");
+    const char *connection = find_header(conn->pending.data, header_length, "Connection");
+    size_t total;
+
+    //HTTP 1.1 defaults to keep-alive, HTTP 1.0 has to ask for it
+    if (connection) {
+        *keep_alive = strncasecmp(connection, "keep-alive", 10) == 0;
+    }else {
+        *keep_alive = strncmp(conn->pending.data, "HTTP/1.0", 8) != 0;
+    }
+
+    if (is_chunked(conn->pending.data, header_length)) {
+        return read_chunked_response(conn, header_length);
+    }else if (content_length) {
+        total = header_length + strtoul(content_length, NULL, 10);
+        while (conn->pending.length < total) {
+            if (fill_pending(conn) <= 0) {
+                return NULL;
+            }
+        }
+    }else {
+        *keep_alive = 0;
+
+        //Without a length the server marks the end by closing
+        while (fill_pending(conn) > 0);
+        total = conn->pending.length;
+    }
+
+    //Step3: hand out the response and keep what follows it
+    Buffer *response = (Buffer*)malloc(sizeof(Buffer));
+    response->data = (char *)malloc(total + 1);
+    memcpy(response->data, conn->pending.data, total);
+    response->data[total] = '\0';
+    response->length = total;
+
+    conn->pending.length -= total;
+    memmove(conn->pending.data, conn->pending.data + total, conn->pending.length);
+
+    return response;
+}
+
+/**
+ * Perform several HTTP 1.1 GET queries to one host over a single
+ * persistent connection. Up to depth requests are written back-to-back
+ * before their responses are read, and responses are read in order.
+ * If the server closes the connection the unanswered requests are sent
+ * again on a new connection.
+ *
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param pages - The page of each request
+ * @param ranges - Byte range of each request, "" for the whole page
+ * @param count - The number of requests
+ * @param depth - The maximum number of requests in flight
+ * @param port - e.g. 80
+ * @param results - Receives one Buffer per request, NULL on failure
+ * @return int - The number of responses received
+ */
+int http_pipeline_query(char *host, char **pages, char **ranges, int count,
+    int depth, int port, Buffer **results) {
+    Connection conn;
+    int sent = 0, received = 0, failures = 0, keep_alive;
+
+    conn.sockfd = -1;
+    conn.capacity = BUFSIZ + 1;
+    conn.pending.data = malloc(conn.capacity);
+    conn.pending.length = 0;
+
+    if (depth < 1) {
+        depth = 1;
+    }
+
+    while (received < count) {
+        //Step1: (re)connect and send again whatever was not answered
+        if (conn.sockfd < 0) {
+            conn.sockfd = client_socket(host, port);
+            conn.pending.length = 0;
+            sent = received;
+        }
+
+        //Step2: keep up to depth requests ahead of the responses
+        while (sent < count && sent - received < depth) {
+            char *http_request = pack_http_request(host, pages[sent], ranges[sent], KEEP_ALIVE);
+            send_http_request(conn.sockfd, http_request);
+            free(http_request);
+            ++sent;
+        }
+
+        //Step3: read the oldest outstanding response
+        Buffer *response = read_http_response(&conn, &keep_alive);
+        if (response) {
+            results[received++] = response;
+            failures = 0;
+        }else if (++failures > 1) {
+            break;
+        }
+
+        if (response == NULL || !keep_alive) {
+            close(conn.sockfd);
+            count_syscalls(1);
+            conn.sockfd = -1;
+        }
+    }
+
+    if (conn.sockfd >= 0) {
+        close(conn.sockfd);
+        count_syscalls(1);
+    }
+
+    for (int i = received; i < count; ++i) {
+        results[i] = NULL;
+    }
+
+    free(conn.pending.data);
+    return received;
+}
+
+
+/**
+ * Splits each url into host and page, then calls http_pipeline_query
+ * to fetch all of them over one connection. All urls must share the
+ * host of the first one.
+ * @param urls - Webpage urls e.g. learn.canterbury.ac.nz/profile
+ * @param ranges - The desired byte range of each url
+ * @param count - The number of urls
+ * @param depth - The maximum number of requests in flight
+ * @param results - Receives one Buffer per url, NULL on failure or for
+ *                  every url from one which could not be split on
+ * @return int - The number of responses received
+ */
+int http_pipeline_url(char **urls, char **ranges, int count, int depth, Buffer **results) {
+    char host[BUF_SIZE];
+    char **copies = malloc(sizeof(char*) * count);
+    char **pages = malloc(sizeof(char*) * count);
+    int received = 0;
+
+    //Urls past one which can not be split are never fetched
+    for (int i = 0; i < count; ++i) {
+        results[i] = NULL;
+    }
+    if (http_split_url(urls[0], host, sizeof host) == NULL) {
+        free(copies);
+        free(pages);
+        return 0;
+    }
+
+    int split = 0;
+    while (split < count) {
+        copies[split] = malloc(BUF_SIZE);
+        pages[split] = http_split_url(urls[split], copies[split], BUF_SIZE);
+
+        if (pages[split] == NULL) {
+            free(copies[split]);
+            break;
+        }
+        ++split;
+    }
+
+    if (split > 0) {
+        received = http_pipeline_query(host, pages, ranges, split, depth, 80, results);
+    }
+
+    for (int i = 0; i < split; ++i) {
+        free(copies[i]);
+    }
+    free(copies);
+    free(pages);
+    return received;
+}
+
+
 /**
  * Gets the content length from response of HEAD request
  * @param response   response from HEAD request
- * @return int  content length
+ * @return long  content length, -1 when the server does not say or
+ *               the value is not a length
  */
-int get_content_size_by_head(Buffer* response){
-    //Find the position of Content-Length in response
-    char *content_length = strstr(response->data, "Content-Length:");
-    char *content_length_end = strstr(content_length, "\n");
-    content_length_end[0] = '\0';
+long get_content_size_by_head(Buffer* response){
+    char *header_end = memmem(response->data, response->length, "\r\n\r\n", 4);
+    size_t header_length = header_end ? header_end + 4 - response->data : response->length;
+    const char *content_length = find_header(response->data, header_length, "Content-Length");
+    char *end;
 
-    char length[BUF_SIZE];
-    int j = 0;
+    if (content_length == NULL || !isdigit((unsigned char)*content_length)) {
+        return -1;
+    }
 
-    //Extract content length in a char array
-    for(int i = 0; content_length[i] != '\0'; ++i){
-        if(content_length[i]>='0' && content_length[i]<='9'){
-            length[j] = content_length[i];
-            j++;
-        }
+    //Files of many GB are fine, but not lengths past what a long holds
+    errno = 0;
+    long long size = strtoll(content_length, &end, 10);
+    if (errno == ERANGE || size > LONG_MAX || (*end != '\r' && *end != '\n' && *end != ' ' && *end != '\0')) {
+        return -1;
     }
-    length[j] = '\0';
-    //Convert char array into number
-    int content_size = atoi(length);
 
-    return content_size;
+    return size;
 }
 
 /**
@@ -239,13 +1490,19 @@ int get_content_size_by_head(Buffer* response){
  * @return int  The number of downloads needed satisfying max_chunk_size
  *              to download the resource
  */
-int calc_tasks(char* is_accept_ranges, int content_size, int threads){
+int calc_tasks(char* is_accept_ranges, long content_size, int threads){
     //Check whether server respect of range or not and calculate max_chunk_size and tasks.
     int tasks = threads; // tasks < Queue Capacity
     // int tasks = threads * 2; //tasks = Queue Capacity
     // int tasks = threads * 3; //tasks > Queue Capacity
 
-    if (is_accept_ranges) {
+    //Unknown length: no plan, open-ended ranges find the size if allowed
+    if (content_size < 0) {
+        max_chunk_size = 0;
+        return is_accept_ranges ? 0 : 1;
+    }
+
+    if (is_accept_ranges && content_size >= tasks) {
         max_chunk_size = content_size / tasks;
     }
     else {
@@ -261,7 +1518,7 @@ int calc_tasks(char* is_accept_ranges, int content_size, int threads){
  * @param url   The URL of the resource to download
  * @param threads   The number of threads to be used for the download
  * @return int  The number of downloads needed satisfying max_chunk_size
- *              to download the resource
+ *              to download the resource, -1 if the url has no page
  */
 int get_num_tasks(char *url, int threads) {
     char host[BUF_SIZE];
@@ -270,15 +1527,9 @@ int get_num_tasks(char *url, int threads) {
     int read_count;
 
     //Separate host and page from url
-    strncpy(host, url, BUF_SIZE);
-
-    char *page = strstr(host, "/");
-    
-    if (page) {
-        page[0] = '\0';
-        ++page;
-    }else {
-        fprintf(stderr, "could not split url into host/page %s\n", url);
+    char *page = http_split_url(url, host, sizeof host);
+    if (page == NULL) {
+        return -1;
     }
     
     //Step1: Setup Socket TCP connection
@@ -306,11 +1557,14 @@ int get_num_tasks(char *url, int threads) {
 
     }
 
+    response->data = realloc(response->data, response->length + 1);
+    response->data[response->length] = '\0';
+
     //step4: Check whether server respect range setting
     char *is_accept_ranges = strstr(response->data, "Accept-Ranges: bytes");
 
     //Step5: Extract content size from HEAD response
-    int content_size = get_content_size_by_head(response);
+    content_size = get_content_size_by_head(response);
     //Base on ranges accept situation, calculate max_chunk_size and return task num
     int tasks = calc_tasks(is_accept_ranges, content_size, threads);
 
@@ -324,6 +1578,81 @@ int get_num_tasks(char *url, int threads) {
 }
 
 
-int get_max_chunk_size() {
+long get_max_chunk_size() {
     return max_chunk_size;
+}
+
+
+long get_content_size() {
+    return content_size;
+}
+
+
+long http_get_syscalls() {
+    return __atomic_load_n(&http_syscalls, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Get the status code of a response e.g. 206
+ * @param response - Buffer containing the HTTP response
+ * @return int - The status code, 0 if there is no status line
+ */
+int http_get_status(Buffer *response) {
+    const char *status = memchr(response->data, ' ', response->length);
+    return status ? atoi(status + 1) : 0;
+}
+
+
+/**
+ * Check that a status holds the bytes a request asked for. A server
+ * ignoring a range answers 200 with the file from its first byte, which
+ * is only what was asked for when no range was.
+ * @param status - The status code of the response
+ * @param range - The range the request asked for, "" or NULL for none
+ * @return int - 1 for a 206 to a range or a 200 to a whole page, else 0
+ */
+int http_status_matches(int status, const char *range) {
+    int ranged = range != NULL && range[0] != '\0';
+
+    return ranged ? status == 206 : status == 200;
+}
+
+
+/**
+ * Get the full size of the resource a response belongs to, from the
+ * Content-Range of a 206 or 416, or the Content-Length of a 200, never
+ * from the body received, which a limit may have cut short
+ * @param response - Buffer containing the HTTP response
+ * @return long - The size in bytes or -1 when the response does not say
+ */
+long http_get_resource_size(Buffer *response) {
+    char *content = http_get_content(response);
+    size_t header_length = content - response->data;
+    long first, last, total;
+
+    switch (http_get_status(response)) {
+    case 206:
+        if (parse_content_range(find_header(response->data, header_length, "Content-Range"),
+            &first, &last, &total) == 0) {
+            return total;
+        }
+        return -1;
+
+    case 416: {
+        //An unsatisfiable range may still say how long the resource is
+        const char *range = find_header(response->data, header_length, "Content-Range");
+        if (range && strncasecmp(range, "bytes */", 8) == 0) {
+            return strtol(range + 8, NULL, 10);
+        }
+        return -1;
+    }
+
+    case 200:
+        //The body may have been cut at a limit, so only the header knows
+        return get_content_size_by_head(response);
+
+    default:
+        return -1;
+    }
 }
\ No newline at end of file
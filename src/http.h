@@ -1,6 +1,11 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+// Methods for pack_http_request
+#define GET "getter"
+#define HEAD "header"
+#define KEEP_ALIVE "keeper"
+
 
 // A buffer object with data, and a length
 typedef struct {
@@ -11,14 +16,95 @@ typedef struct {
 
 
 /**
- * Perform an HTTP 1.0 query to a given host and page and port number.
+ * Create Client Socket by TCP
+ * @param host_name - The host name e.g. www.canterbury.ac.nz
+ * @param server_port - e.g. 80
+ * @return int - The connected socket
+ */
+int client_socket(char *host_name, int server_port);
+
+
+/**
+ * Create Http Request Packet
+ * User is responsible for freeing the memory.
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param page - e.g. /index.html
+ * @param range - Byte range e.g. 0-500. NOTE: A server may not respect this
+ * @param method - GET, HEAD or KEEP_ALIVE (GET over a persistent connection)
+ * @return char* - The request
+ */
+char* pack_http_request(char* host, char* page, const char* range, const char* method);
+
+
+/**
+ * Write an Http Request Packet into memory supplied by the caller, which
+ * has room for 1024 bytes plus the lengths of the fields
+ * @param http_request_packet - Where the request is written
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param page - e.g. /index.html
+ * @param range - Byte range e.g. 0-500. NOTE: A server may not respect this
+ * @param method - GET, HEAD or KEEP_ALIVE (GET over a persistent connection)
+ */
+void format_http_request(char *http_request_packet, char* host, char* page,
+    const char* range, const char* method);
+
+
+/*
+ * HttpStream - a response body being read from its connection piece
+ * by piece. The implementation is hidden from the outside.
+ */
+typedef struct HttpStreamStruct HttpStream;
+
+
+// Receives decoded body bytes, returns non-zero to stop decoding
+typedef int (*http_sink)(void *arg, const char *data, size_t length);
+
+
+// Incremental decoder for a chunked Transfer-Encoding body
+typedef struct {
+    enum {
+        CHUNK_SIZE, CHUNK_SIZE_LINE, CHUNK_DATA, CHUNK_DATA_END,
+        CHUNK_TRAILER, CHUNK_TRAILER_LINE, CHUNK_DONE, CHUNK_ERROR
+    } state;
+    size_t remaining;   // Payload bytes left in the current chunk
+    int digits;         // Hex digits seen of the current size
+
+} ChunkDecoder;
+
+
+// Receives body bytes of a response to a range request along with the
+// position of the first of them within the resource, returns non-zero
+// to stop receiving
+typedef int (*http_part_sink)(void *arg, long offset, const char *data, size_t length);
+
+
+// Incremental parser for a multipart/byteranges body
+typedef struct {
+    enum {
+        PART_BOUNDARY, PART_HEADER, PART_DATA, PART_DONE, PART_ERROR
+    } state;
+    char boundary[80];      // The delimiter line, "--" then the boundary
+    size_t boundary_length;
+    char line[256];         // The delimiter or part header line so far
+    size_t line_length;
+    int has_range;          // The part header held a Content-Range
+    long offset;            // Position of the next part byte in the resource
+    size_t remaining;       // Bytes left in the current part
+
+} MultipartParser;
+
+
+/**
+ * Perform an HTTP 1.1 query to a given host and page and port number.
  * host is a hostname and page is a path on the remote server. The query
  * will attempt to retrievev content in the given byte range.
+ * A chunked body is decoded, so the returned content is the payload.
  * User is responsible for freeing the memory.
  * 
  * @param host - The host name e.g. www.canterbury.ac.nz
  * @param page - e.g. /index.html
- * @param range - Byte range e.g. 0-500. NOTE: A server may not respect this
+ * @param range - Byte range e.g. 0-500. Several ranges may be given
+ *                e.g. 0-99,200-299. NOTE: A server may not respect this
  * @param port - e.g. 80
  * @return Buffer - Pointer to a buffer holding response data from query
  *                  NULL is returned on failure.
@@ -26,6 +112,93 @@ typedef struct {
 Buffer* http_query(char *host, char *page, const char *range, int port);
 
 
+/**
+ * Perform an HTTP 1.1 query like http_query, but stop reading once the
+ * body holds max_body bytes and close the connection, cancelling the
+ * rest of the transfer. Useful with open-ended ranges e.g. 500-
+ * 
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param page - e.g. /index.html
+ * @param range - Byte range e.g. 0-500. NOTE: A server may not respect this
+ * @param port - e.g. 80
+ * @param max_body - The most body bytes to keep, 0 for no limit
+ * @return Buffer - Pointer to a buffer holding response data from query
+ *                  NULL is returned on failure.
+ */
+Buffer* http_query_limit(char *host, char *page, const char *range, int port, size_t max_body);
+
+
+/**
+ * Perform an HTTP 1.1 query like http_query, but receive the body
+ * directly into memory supplied by the caller instead of a Buffer.
+ * Only the header (and any body bytes arriving with it) pass through a
+ * scratch buffer. Reading stops once capacity bytes have arrived.
+ * 
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param page - e.g. /index.html
+ * @param range - Byte range e.g. 0-500. NOTE: A server may not respect this
+ * @param port - e.g. 80
+ * @param dest - Where the body is stored
+ * @param capacity - The most body bytes to store
+ * @return long - The body bytes stored, -1 on failure or a status other
+ *                than the one http_status_matches expects
+ */
+long http_query_into(char *host, char *page, const char *range, int port,
+    char *dest, size_t capacity);
+
+
+/**
+ * Perform an HTTP 1.1 query like http_query_limit, but receive the
+ * whole response into memory supplied by the caller, e.g. a pooled
+ * segment. The request is written into the same memory before the
+ * response overwrites it and a chunked body is decoded in place, so
+ * nothing is allocated and no scratch buffer is copied through.
+ *
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param page - e.g. /index.html
+ * @param range - Byte range e.g. 0-500. NOTE: A server may not respect this
+ * @param port - e.g. 80
+ * @param max_body - The most body bytes to keep, 0 for no limit
+ * @param memory - Where the response is stored, NUL terminated
+ * @param capacity - The size of memory
+ * @param response - Set to the response, its data pointing into memory
+ * @return int - 0 on success, -1 on failure or if the response did not fit
+ */
+int http_query_buffer(char *host, char *page, const char *range, int port,
+    size_t max_body, char *memory, size_t capacity, Buffer *response);
+
+
+/**
+ * Send an HTTP 1.1 GET for a url and read its response header, leaving
+ * the body on the connection to be read with http_stream_read into
+ * memory of the caller's choosing, e.g. aligned or pooled buffers.
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * @param range - The desired byte range of data to retrieve from the page
+ * @return stream - The open stream, NULL on failure or a status other
+ *                  than the one http_status_matches expects
+ */
+HttpStream *http_stream_open(const char *url, const char *range);
+
+
+/**
+ * Read the next body bytes of a stream. Bytes which arrived with the
+ * header are copied out first, the rest is read straight into dest.
+ * A chunked body is decoded in place in dest.
+ * @param stream - The stream to read from
+ * @param dest - Where to store the bytes
+ * @param length - The most bytes to read
+ * @return long - The bytes read, 0 at the end of the body, -1 on error
+ */
+long http_stream_read(HttpStream *stream, char *dest, size_t length);
+
+
+/**
+ * Close a stream's connection and free it
+ * @param stream - The stream to close
+ */
+void http_stream_close(HttpStream *stream);
+
+
 /**
  * Separate the content from the header of an http request.
  * NOTE: returned string is an offset into the response, so
@@ -37,6 +210,116 @@ Buffer* http_query(char *host, char *page, const char *range, int port);
 char* http_get_content(Buffer *response);
 
 
+/**
+ * Get the status code of a response e.g. 206
+ * @param response - Buffer containing the HTTP response
+ * @return int - The status code, 0 if there is no status line
+ */
+int http_get_status(Buffer *response);
+
+
+/**
+ * Check that a status holds the bytes a request asked for. A server
+ * ignoring a range answers 200 with the file from its first byte, which
+ * is only what was asked for when no range was.
+ * @param status - The status code of the response
+ * @param range - The range the request asked for, "" or NULL for none
+ * @return int - 1 for a 206 to a range or a 200 to a whole page, else 0
+ */
+int http_status_matches(int status, const char *range);
+
+
+/**
+ * Get the full size of the resource a response belongs to, from the
+ * Content-Range of a 206 or 416, or the Content-Length of a 200
+ * @param response - Buffer containing the HTTP response
+ * @return long - The size in bytes or -1 when the response does not say
+ */
+long http_get_resource_size(Buffer *response);
+
+
+/**
+ * Prepare a decoder for the start of a chunked body
+ * @param decoder - The decoder to reset
+ */
+void chunk_decoder_init(ChunkDecoder *decoder);
+
+
+/**
+ * Decode the next bytes of a chunked body. Chunk sizes and framing are
+ * parsed in place and each run of payload bytes is handed to the sink
+ * directly from data, so payload is never copied by the decoder.
+ * @param decoder - Decoder state carried between calls
+ * @param data - The next bytes of the body as received
+ * @param length - The number of bytes in data
+ * @param sink - Called with each run of decoded payload bytes
+ * @param arg - Passed to the sink
+ * @return size_t - The bytes of data consumed. Less than length only once
+ *                  the body is complete (or malformed), when the rest
+ *                  belongs to whatever follows the body.
+ */
+size_t chunk_decode(ChunkDecoder *decoder, const char *data, size_t length,
+    http_sink sink, void *arg);
+
+
+/**
+ * Prepare a parser for a multipart/byteranges body
+ * @param parser - The parser to reset
+ * @param content_type - The Content-Type value of the response
+ * @return int - 0 on success, -1 if the type has no usable boundary
+ */
+int multipart_parser_init(MultipartParser *parser, const char *content_type);
+
+
+/**
+ * Parse the next bytes of a multipart/byteranges body. Delimiters and
+ * part headers are parsed as they arrive and the bytes of each part are
+ * handed to the sink, with their offset from the part's Content-Range,
+ * directly from data.
+ * @param parser - Parser state carried between calls
+ * @param data - The next (decoded) bytes of the body
+ * @param length - The number of bytes in data
+ * @param sink - Called with each run of part bytes
+ * @param arg - Passed to the sink
+ * @return size_t - The bytes of data consumed. Less than length only once
+ *                  the closing delimiter was seen or the body is malformed
+ */
+size_t multipart_parse(MultipartParser *parser, const char *data, size_t length,
+    http_part_sink sink, void *arg);
+
+
+/**
+ * Perform an HTTP 1.1 query for one or more ranges and stream the body
+ * to a sink as it is received, each byte with its position within the
+ * resource. A multipart/byteranges body is split into its parts on the
+ * fly, a single range is placed by its Content-Range and a 200 response
+ * (the server ignored the ranges) starts at offset 0. Nothing is
+ * buffered beyond one read.
+ *
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param page - e.g. /index.html
+ * @param range - Byte ranges e.g. 0-99,200-299
+ * @param port - e.g. 80
+ * @param sink - Called with each run of body bytes
+ * @param arg - Passed to the sink
+ * @return int - 0 once the whole body was received, -1 on failure, an
+ *               error status or if the sink stopped it
+ */
+int http_query_parts(char *host, char *page, const char *range, int port,
+    http_part_sink sink, void *arg);
+
+
+/**
+ * Split a url into its host and page, e.g. learn.canterbury.ac.nz/profile
+ * into learn.canterbury.ac.nz and profile. Both are copied into host.
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * @param host - Receives the host, followed by the page
+ * @param size - The size of host in bytes
+ * @return char* - The page, inside host, or NULL if the url has no page
+ */
+char *http_split_url(const char *url, char *host, size_t size);
+
+
 /**
  * Splits an HTTP url into host, page. On success, calls http_query
  * to execute the query against the url. 
@@ -47,6 +330,91 @@ char* http_get_content(Buffer *response);
 Buffer *http_url(const char *url, const char *range);
 
 
+/**
+ * Splits an HTTP url into host, page. On success, calls http_query_limit
+ * to execute the query against the url, keeping at most max_body bytes.
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * @param range - The desired byte range of data to retrieve from the page
+ * @param max_body - The most body bytes to keep, 0 for no limit
+ * @return Buffer pointer holding raw string data or NULL on failure
+ */
+Buffer *http_url_limit(const char *url, const char *range, size_t max_body);
+
+
+/**
+ * Splits an HTTP url into host, page. On success, calls http_query_into
+ * to receive the body directly into dest.
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * @param range - The desired byte range of data to retrieve from the page
+ * @param dest - Where the body is stored
+ * @param capacity - The most body bytes to store
+ * @return long - The body bytes stored, -1 on failure
+ */
+long http_url_into(const char *url, const char *range, char *dest, size_t capacity);
+
+
+/**
+ * Splits an HTTP url into host, page. On success, calls http_query_parts
+ * to stream the parts of the response to a sink.
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * @param range - The desired byte ranges of data to retrieve from the page
+ * @param sink - Called with each run of body bytes and their offset
+ * @param arg - Passed to the sink
+ * @return int - 0 once the whole body was received, -1 on failure
+ */
+int http_url_parts(const char *url, const char *range, http_part_sink sink, void *arg);
+
+
+/**
+ * Splits an HTTP url into host, page. On success, calls http_query_buffer
+ * to receive the response into memory supplied by the caller.
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * @param range - The desired byte range of data to retrieve from the page
+ * @param max_body - The most body bytes to keep, 0 for no limit
+ * @param memory - Where the response is stored
+ * @param capacity - The size of memory
+ * @param response - Set to the response, its data pointing into memory
+ * @return int - 0 on success, -1 on failure or if the response did not fit
+ */
+int http_url_buffer(const char *url, const char *range, size_t max_body,
+    char *memory, size_t capacity, Buffer *response);
+
+
+/**
+ * Perform several HTTP 1.1 GET queries to one host over a single
+ * persistent connection. Up to depth requests are written back-to-back
+ * before their responses are read, and responses are read in order.
+ * If the server closes the connection the unanswered requests are sent
+ * again on a new connection.
+ *
+ * @param host - The host name e.g. www.canterbury.ac.nz
+ * @param pages - The page of each request
+ * @param ranges - Byte range of each request, "" for the whole page
+ * @param count - The number of requests
+ * @param depth - The maximum number of requests in flight
+ * @param port - e.g. 80
+ * @param results - Receives one Buffer per request, NULL on failure
+ * @return int - The number of responses received
+ */
+int http_pipeline_query(char *host, char **pages, char **ranges, int count,
+    int depth, int port, Buffer **results);
+
+
+/**
+ * Splits each url into host and page, then calls http_pipeline_query
+ * to fetch all of them over one connection. All urls must share the
+ * host of the first one.
+ * @param urls - Webpage urls e.g. learn.canterbury.ac.nz/profile
+ * @param ranges - The desired byte range of each url
+ * @param count - The number of urls
+ * @param depth - The maximum number of requests in flight
+ * @param results - Receives one Buffer per url, NULL on failure or for
+ *                  every url from one which could not be split on
+ * @return int - The number of responses received
+ */
+int http_pipeline_url(char **urls, char **ranges, int count, int depth, Buffer **results);
+
+
 /**
  * Free a buffer
  * @param buffer - Pointer to a buffer to free
@@ -63,12 +431,20 @@ inline static void buffer_free(Buffer *buffer) {
  * @param url   The URL of the resource to download
  * @param threads   The number of threads to be used for the download
  * @return int  The number of downloads needed satisfying maxByteSize
- *              to download the resource
+ *              to download the resource, 0 when the size is unknown
+ *              but the server accepts ranges, -1 if the url has no page
  */
 int get_num_tasks(char *url, int threads);
 
-int max_chunk_size; // The maximum size in bytes of a chunk to download
+extern long max_chunk_size; // The maximum size in bytes of a chunk to download
+extern long content_size; // The size in bytes of the resource, -1 if unknown
+
+long get_max_chunk_size(void);
+
+long get_content_size(void);
+
+extern long http_syscalls; // System calls made by socket reads, writes and setup
 
-int get_max_chunk_size(void);
+long http_get_syscalls(void);
 
 #endif
@@ -0,0 +1,221 @@
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define HUGE_PAGE_SIZE (2 << 20)    //Transparent huge page size on x86-64 and arm64
+
+
+/*
+ * Pool - a thread safe pool of fixed size, aligned memory segments.
+ * Free segments are kept on a stack so the most recently used (and
+ * most likely cache and TLB warm) segment is handed out first.
+ */
+typedef struct PoolStruct {
+    size_t segment_size;
+    size_t alignment;
+    int huge;               //Back segments with transparent huge pages
+    char **free_segments;   //Stack of segments ready for reuse
+    int num_free;
+    int capacity;
+    char **segments;        //Every segment allocated, to free and measure them
+    int num_segments;
+    long hits;              //Gets served from the free stack
+    long misses;            //Gets which had to allocate
+    pthread_mutex_t mutex;  //pretect the free stack and counters
+} Pool;
+
+
+/**
+ * Allocate a pool handing out segments of a given size and alignment
+ * @param segment_size - The size of each segment in bytes
+ * @param alignment - The alignment of each segment, a power of two
+ * @return pool - Pointer to the allocated pool
+ */
+Pool *pool_alloc(size_t segment_size, size_t alignment) {
+    Pool *pool = (Pool*)malloc(sizeof(Pool));
+    pool->segment_size = segment_size;
+    pool->alignment = alignment;
+    pool->huge = 0;
+    pool->free_segments = NULL;
+    pool->num_free = 0;
+    pool->capacity = 0;
+    pool->segments = NULL;
+    pool->num_segments = 0;
+    pool->hits = 0;
+    pool->misses = 0;
+    pthread_mutex_init(&pool->mutex, NULL);
+
+    return pool;
+}
+
+
+/**
+ * Allocate a pool whose segments are backed by transparent huge pages,
+ * cutting the page faults and TLB misses of touching large buffers.
+ * The segment size is rounded up to whole huge pages.
+ * @param segment_size - The least size of each segment in bytes
+ * @return pool - Pointer to the allocated pool
+ */
+Pool *pool_alloc_huge(size_t segment_size) {
+    segment_size = (segment_size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+
+    Pool *pool = pool_alloc(segment_size, HUGE_PAGE_SIZE);
+    pool->huge = 1;
+
+    return pool;
+}
+
+
+/**
+ * Free a pool and every segment returned to it
+ *
+ * Don't call this function while segments are still checked out.
+ * 
+ * @param pool - Pointer to the pool to free
+ */
+void pool_free(Pool *pool) {
+    for (int i = 0; i < pool->num_segments; ++i) {
+        free(pool->segments[i]);
+    }
+    free(pool->segments);
+    free(pool->free_segments);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+
+/**
+ * Change the size of the segments a pool hands out, freeing the segments
+ * of the old size. A huge page pool rounds the size up to whole huge pages.
+ *
+ * Don't call this function while segments are still checked out.
+ *
+ * @param pool - Pointer to the pool
+ * @param segment_size - The least size of each segment in bytes
+ */
+void pool_resize(Pool *pool, size_t segment_size) {
+    if (pool->huge) {
+        segment_size = (segment_size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    for (int i = 0; i < pool->num_segments; ++i) {
+        free(pool->segments[i]);
+    }
+    pool->num_segments = 0;
+    pool->num_free = 0;
+    pool->segment_size = segment_size;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+
+/**
+ * Check a segment out of the pool, allocating one if none is free
+ * @param pool - Pointer to the pool
+ * @return char* - A segment of the pool's size and alignment
+ */
+char *pool_get(Pool *pool) {
+    char *segment = NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->num_free > 0) {
+        segment = pool->free_segments[--pool->num_free];
+        ++pool->hits;
+    }
+    else {
+        ++pool->misses;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (segment == NULL) {
+        void *memory;
+        if (posix_memalign(&memory, pool->alignment, pool->segment_size) != 0) {
+            perror("posix_memalign");
+            exit(EXIT_FAILURE);
+        }
+        segment = memory;
+
+        //Only a hint, kernels without huge pages carry on with small ones
+        if (pool->huge) {
+            madvise(segment, pool->segment_size, MADV_HUGEPAGE);
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->segments = realloc(pool->segments, sizeof(char*) * (pool->num_segments + 1));
+        pool->segments[pool->num_segments++] = segment;
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    return segment;
+}
+
+
+/**
+ * Return a segment to the pool for reuse
+ * @param pool - Pointer to the pool the segment came from
+ * @param segment - The segment to return
+ */
+void pool_put(Pool *pool, char *segment) {
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->num_free == pool->capacity) {
+        pool->capacity = pool->capacity ? pool->capacity * 2 : 8;
+        pool->free_segments = realloc(pool->free_segments, sizeof(char*) * pool->capacity);
+    }
+    pool->free_segments[pool->num_free++] = segment;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+
+/**
+ * The size of each segment of a pool
+ * @param pool - Pointer to the pool
+ * @return size_t - The segment size in bytes
+ */
+size_t pool_segment_size(Pool *pool) {
+    return pool->segment_size;
+}
+
+
+/**
+ * How often the pool could hand out a segment without allocating
+ * @param pool - Pointer to the pool
+ * @param hits - Set to the gets served from free segments
+ * @param misses - Set to the gets which allocated a segment
+ */
+void pool_stats(Pool *pool, long *hits, long *misses) {
+    pthread_mutex_lock(&pool->mutex);
+    *hits = pool->hits;
+    *misses = pool->misses;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+
+/**
+ * The bytes of the pool's segments resident in memory, i.e. touched
+ * @param pool - Pointer to the pool
+ * @return long - The resident bytes
+ */
+long pool_resident(Pool *pool) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t pages = (pool->segment_size + page_size - 1) / page_size;
+    unsigned char *vec = malloc(pages);
+    long resident = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    for (int i = 0; i < pool->num_segments; ++i) {
+        if (mincore(pool->segments[i], pool->segment_size, vec) != 0) {
+            continue;
+        }
+        for (size_t j = 0; j < pages; ++j) {
+            resident += (vec[j] & 1) * page_size;
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    free(vec);
+    return resident;
+}
@@ -0,0 +1,97 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+
+/*
+ * Pool - a thread safe pool of fixed size, aligned memory segments which
+ * are reused instead of being allocated for every chunk.
+ * The implementation is hidden from the outside.
+ */
+typedef struct PoolStruct Pool;
+
+
+/**
+ * Allocate a pool handing out segments of a given size and alignment
+ * @param segment_size - The size of each segment in bytes
+ * @param alignment - The alignment of each segment, a power of two
+ * @return pool - Pointer to the allocated pool
+ */
+Pool *pool_alloc(size_t segment_size, size_t alignment);
+
+
+/**
+ * Allocate a pool whose segments are backed by transparent huge pages,
+ * cutting the page faults and TLB misses of touching large buffers.
+ * The segment size is rounded up to whole huge pages.
+ * @param segment_size - The least size of each segment in bytes
+ * @return pool - Pointer to the allocated pool
+ */
+Pool *pool_alloc_huge(size_t segment_size);
+
+
+/**
+ * Free a pool and every segment returned to it
+ *
+ * Don't call this function while segments are still checked out.
+ * 
+ * @param pool - Pointer to the pool to free
+ */
+void pool_free(Pool *pool);
+
+
+/**
+ * Change the size of the segments a pool hands out, freeing the segments
+ * of the old size. A huge page pool rounds the size up to whole huge pages.
+ *
+ * Don't call this function while segments are still checked out.
+ *
+ * @param pool - Pointer to the pool
+ * @param segment_size - The least size of each segment in bytes
+ */
+void pool_resize(Pool *pool, size_t segment_size);
+
+
+/**
+ * Check a segment out of the pool, allocating one if none is free
+ * @param pool - Pointer to the pool
+ * @return char* - A segment of the pool's size and alignment
+ */
+char *pool_get(Pool *pool);
+
+
+/**
+ * Return a segment to the pool for reuse
+ * @param pool - Pointer to the pool the segment came from
+ * @param segment - The segment to return
+ */
+void pool_put(Pool *pool, char *segment);
+
+
+/**
+ * The size of each segment of a pool
+ * @param pool - Pointer to the pool
+ * @return size_t - The segment size in bytes
+ */
+size_t pool_segment_size(Pool *pool);
+
+
+/**
+ * How often the pool could hand out a segment without allocating
+ * @param pool - Pointer to the pool
+ * @param hits - Set to the gets served from free segments
+ * @param misses - Set to the gets which allocated a segment
+ */
+void pool_stats(Pool *pool, long *hits, long *misses);
+
+
+/**
+ * The bytes of the pool's segments resident in memory, i.e. touched
+ * @param pool - Pointer to the pool
+ * @return long - The resident bytes
+ */
+long pool_resident(Pool *pool);
+
+
+#endif
@@ -0,0 +1,118 @@
+#include "pqueue.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdlib.h>
+
+
+/*
+ * PQueue - a concurrent bounded priority queue: a binary heap guarded by
+ * a mutex, with the same full and empty semaphores as Queue
+ */
+typedef struct PQueueStruct {
+    sem_t full;     //Items in the heap
+    sem_t empty;    //Free places in the heap
+    void **heap;    //heap[0] ranks first, children of i at 2i+1 and 2i+2
+    size_t size;
+    pqueue_compare_fn compare;
+    pthread_mutex_t mutex;   //pretect the heap
+} PQueue;
+
+
+/**
+ * Allocate a concurrent priority queue of a specific size
+ * @param size - The most items held at once
+ * @param compare - Ranks two items, the lowest goes first
+ * @return queue - Pointer to the allocated queue
+ */
+PQueue *pqueue_alloc(int size, pqueue_compare_fn compare) {
+    PQueue *queue = (PQueue*)malloc(sizeof(PQueue));
+    queue->heap = (void**)malloc(sizeof(void*) * size);
+    queue->size = 0;
+    queue->compare = compare;
+    sem_init(&queue->full, 0, 0);
+    sem_init(&queue->empty, 0, size);
+    pthread_mutex_init(&queue->mutex, NULL);
+
+    return queue;
+}
+
+
+/**
+ * Free a concurrent priority queue and associated memory
+ *
+ * Don't call this function while the queue is still in use.
+ *
+ * @param queue - Pointer to the queue to free
+ */
+void pqueue_free(PQueue *queue) {
+    sem_destroy(&queue->full);
+    sem_destroy(&queue->empty);
+    pthread_mutex_destroy(&queue->mutex);
+    free(queue->heap);
+    free(queue);
+}
+
+
+/**
+ * Place an item into the priority queue, blocking until there is space
+ * @param queue - Pointer to the queue to add an item to
+ * @param item - An item to add to queue
+ */
+void pqueue_put(PQueue *queue, void *item) {
+    sem_wait(&queue->empty);
+    pthread_mutex_lock(&queue->mutex);
+
+    //Sift the new item up from the last place
+    size_t i = queue->size++;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (queue->compare(queue->heap[parent], item) <= 0) {
+            break;
+        }
+        queue->heap[i] = queue->heap[parent];
+        i = parent;
+    }
+    queue->heap[i] = item;
+
+    pthread_mutex_unlock(&queue->mutex);
+    sem_post(&queue->full);
+}
+
+
+/**
+ * Get the first ranked item from the priority queue, blocking until one
+ * is available
+ * @param queue - Pointer to queue to get item from
+ * @return item - The item the comparator ranks lowest
+ */
+void *pqueue_get(PQueue *queue) {
+    sem_wait(&queue->full);
+    pthread_mutex_lock(&queue->mutex);
+
+    void *item = queue->heap[0];
+    void *last = queue->heap[--queue->size];
+
+    //Sift the last item down from the top
+    size_t i = 0;
+    while (1) {
+        size_t child = 2 * i + 1;
+        if (child >= queue->size) {
+            break;
+        }
+        if (child + 1 < queue->size && queue->compare(queue->heap[child + 1], queue->heap[child]) < 0) {
+            ++child;
+        }
+        if (queue->compare(last, queue->heap[child]) <= 0) {
+            break;
+        }
+        queue->heap[i] = queue->heap[child];
+        i = child;
+    }
+    queue->heap[i] = last;
+
+    pthread_mutex_unlock(&queue->mutex);
+    sem_post(&queue->empty);
+
+    return item;
+}
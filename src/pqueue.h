@@ -0,0 +1,53 @@
+#ifndef PQUEUE_H
+#define PQUEUE_H
+
+
+/*
+ * PQueue - a concurrent bounded priority queue. It blocks like Queue, but
+ * hands out the item its comparator ranks first instead of the oldest.
+ * The implementation is hidden from the outside.
+ */
+typedef struct PQueueStruct PQueue;
+
+
+// Negative when item a goes before item b, positive when after, else 0
+typedef int (*pqueue_compare_fn)(const void *a, const void *b);
+
+
+/**
+ * Allocate a concurrent priority queue of a specific size
+ * @param size - The most items held at once
+ * @param compare - Ranks two items, the lowest goes first
+ * @return queue - Pointer to the allocated queue
+ */
+PQueue *pqueue_alloc(int size, pqueue_compare_fn compare);
+
+
+/**
+ * Free a concurrent priority queue and associated memory
+ *
+ * Don't call this function while the queue is still in use.
+ *
+ * @param queue - Pointer to the queue to free
+ */
+void pqueue_free(PQueue *queue);
+
+
+/**
+ * Place an item into the priority queue, blocking until there is space
+ * @param queue - Pointer to the queue to add an item to
+ * @param item - An item to add to queue
+ */
+void pqueue_put(PQueue *queue, void *item);
+
+
+/**
+ * Get the first ranked item from the priority queue, blocking until one
+ * is available
+ * @param queue - Pointer to queue to get item from
+ * @return item - The item the comparator ranks lowest
+ */
+void *pqueue_get(PQueue *queue);
+
+
+#endif
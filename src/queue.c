@@ -6,6 +6,21 @@
 #include <stdio.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#define SPIN_MAX 4096   //Most polls of a semaphore before parking on it
+#define SPIN_MIN 16     //Least polls, so the limit can grow back
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
 
 #define handle_error_en(en, msg) \
         do { errno = en; perror(msg); exit(EXIT_FAILURE); } while (0)
@@ -25,6 +40,14 @@ typedef struct QueueStruct {
     void **task;    //pointer to task which is wait for proceed
     size_t size;    //Queue size
     pthread_mutex_t mutex;   //pretect critical resource
+    int event_fd;   //Readable while items may be waiting, -1 for none
+    int signalled;  //Whether event_fd was signalled since the last drain
+    int spin_max;   //Ceiling of spin, 0 to park at once
+    int spin;       //Polls before parking, tuned by how long waits take
+    long spun;      //Waits which ended while spinning
+    long parked;    //Waits which had to sleep in the kernel
+    QueueStats *stats;  //Counters, NULL unless enabled
+    long changed_ns;    //When size last changed, for the depth histogram
 } Queue;
 
 
@@ -41,11 +64,271 @@ Queue *queue_alloc(int size) {
     sem_init(&queue->full, 0, 0);
     sem_init(&queue->empty, 0, size);
     pthread_mutex_init(&queue->mutex, NULL);
+    queue->event_fd = -1;
+    queue->signalled = 0;
+
+    //Spinning only pays off when the other side runs meanwhile
+    queue->spin_max = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN_MAX : 0;
+    queue->spin = queue->spin_max > 0 ? SPIN_MIN : 0;
+    queue->spun = 0;
+    queue->parked = 0;
+    queue->stats = NULL;
+
+    return queue;
+}
+
+
+/**
+ * The monotonic clock in nanoseconds
+ */
+static long now_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+
+/**
+ * The depth histogram bucket of a depth: 0, 1, 2-3, 4-7 and so on
+ */
+static int depth_bucket(long depth) {
+    int bucket = 0;
+
+    while (depth > 0 && bucket < QUEUE_DEPTH_BUCKETS - 1) {
+        depth >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+
+
+/**
+ * Start counting puts, gets, blocked time and depth on a queue. Until
+ * then a queue only pays a test of a NULL pointer per call.
+ * @param queue - Pointer to the queue
+ */
+void queue_enable_stats(Queue *queue) {
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->stats == NULL) {
+        queue->stats = (QueueStats*)calloc(1, sizeof(QueueStats));
+        queue->changed_ns = now_ns();
+    }
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+
+/**
+ * Read the counters of a queue
+ * @param queue - Pointer to the queue
+ * @param stats - Where the counters are copied to
+ * @return int - 0 on success, -1 if they were never enabled
+ */
+int queue_stats(Queue *queue, QueueStats *stats) {
+    if (queue->stats == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+    *stats = *queue->stats;
+    stats->depth_ns[depth_bucket(queue->size)] += now_ns() - queue->changed_ns;
+    pthread_mutex_unlock(&queue->mutex);
+
+    stats->put_blocked_ns = __atomic_load_n(&queue->stats->put_blocked_ns, __ATOMIC_RELAXED);
+    stats->get_blocked_ns = __atomic_load_n(&queue->stats->get_blocked_ns, __ATOMIC_RELAXED);
+    return 0;
+}
+
+
+/**
+ * Add the counters of one queue to those of another, e.g. to sum up
+ * queues which do the same job
+ * @param total - The counters added to
+ * @param stats - The counters to add
+ */
+void queue_stats_add(QueueStats *total, const QueueStats *stats) {
+    total->puts += stats->puts;
+    total->gets += stats->gets;
+    total->put_blocked_ns += stats->put_blocked_ns;
+    total->get_blocked_ns += stats->get_blocked_ns;
+    total->lock_wait_ns += stats->lock_wait_ns;
+    for (int i = 0; i < QUEUE_DEPTH_BUCKETS; ++i) {
+        total->depth_ns[i] += stats->depth_ns[i];
+    }
+}
+
+
+/**
+ * Print the counters of a queue
+ * @param name - What the queue is for
+ * @param stats - The counters
+ */
+void queue_print_stats(const char *name, const QueueStats *stats) {
+    long total_ns = 0;
+
+    printf(">>queue %s: %ld puts, %ld gets, blocked %.3f s putting, %.3f s getting, %.3f s on the lock\n",
+        name, stats->puts, stats->gets, stats->put_blocked_ns / 1e9,
+        stats->get_blocked_ns / 1e9, stats->lock_wait_ns / 1e9);
+
+    for (int i = 0; i < QUEUE_DEPTH_BUCKETS; ++i) {
+        total_ns += stats->depth_ns[i];
+    }
+    printf("   depth over time:");
+    for (int i = 0; i < QUEUE_DEPTH_BUCKETS; ++i) {
+        if (stats->depth_ns[i] == 0) {
+            continue;
+        }
+        if (i < 2) {
+            printf(" %d: %.1f%%", i, 100.0 * stats->depth_ns[i] / total_ns);
+        }
+        else if (i < QUEUE_DEPTH_BUCKETS - 1) {
+            printf(" %d-%d: %.1f%%", 1 << (i - 1), (1 << i) - 1, 100.0 * stats->depth_ns[i] / total_ns);
+        }
+        else {
+            printf(" %d+: %.1f%%", 1 << (i - 1), 100.0 * stats->depth_ns[i] / total_ns);
+        }
+    }
+    printf("\n");
+}
+
+
+/**
+ * Lock a queue, timing the wait when it is contended
+ */
+static void lock_queue(Queue *queue) {
+    if (queue->stats == NULL || pthread_mutex_trylock(&queue->mutex) != 0) {
+        long start = queue->stats ? now_ns() : 0;
+
+        pthread_mutex_lock(&queue->mutex);
+        if (queue->stats) {
+            queue->stats->lock_wait_ns += now_ns() - start;
+        }
+    }
+}
+
 
+/**
+ * Count a change of size on a locked queue, before it happens
+ */
+static void count_change(Queue *queue, int puts, int gets) {
+    if (queue->stats) {
+        long now = now_ns();
+
+        queue->stats->depth_ns[depth_bucket(queue->size)] += now - queue->changed_ns;
+        queue->changed_ns = now;
+        queue->stats->puts += puts;
+        queue->stats->gets += gets;
+    }
+}
+
+
+/**
+ * Count the time a thread was blocked on one of the semaphores of a queue
+ */
+static void count_blocked(Queue *queue, sem_t *sem, long start) {
+    long *blocked = sem == &queue->full ? &queue->stats->get_blocked_ns : &queue->stats->put_blocked_ns;
+
+    __atomic_add_fetch(blocked, now_ns() - start, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Set the most polls a thread waiting on the queue spins for before it
+ * sleeps. Within it the queue tunes how long to spin by itself.
+ * By default threads spin only when more than one CPU is online.
+ * @param queue - Pointer to the queue
+ * @param spin_max - The most polls, 0 to sleep at once
+ */
+void queue_set_spin(Queue *queue, int spin_max) {
+    queue->spin_max = spin_max;
+    queue->spin = spin_max < SPIN_MIN ? spin_max : SPIN_MIN;
+}
+
+
+/**
+ * How waits on the queue ended so far
+ * @param queue - Pointer to the queue
+ * @param spun - Set to the waits which ended while spinning
+ * @param parked - Set to the waits which had to sleep
+ */
+void queue_spin_stats(Queue *queue, long *spun, long *parked) {
+    *spun = __atomic_load_n(&queue->spun, __ATOMIC_RELAXED);
+    *parked = __atomic_load_n(&queue->parked, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Take a unit of a semaphore, polling it for a while before sleeping on
+ * its futex. A wait that ends while spinning saves a sleep and a wake
+ * up, so the spin moves towards twice what the last one needed; one that
+ * had to sleep wasted its spin, so the spin halves.
+ * @param queue - Pointer to the queue the semaphore belongs to
+ * @param sem - The semaphore
+ */
+static void spin_wait(Queue *queue, sem_t *sem) {
+    if (sem_trywait(sem) == 0) {
+        return;
+    }
+    long start = queue->stats ? now_ns() : 0;
+
+    int spin = __atomic_load_n(&queue->spin, __ATOMIC_RELAXED);
+    for (int i = 0; i < spin; ++i) {
+        cpu_relax();
+        if (sem_trywait(sem) == 0) {
+            int target = 2 * i + SPIN_MIN;
+            if (target > queue->spin_max) {
+                target = queue->spin_max;
+            }
+            __atomic_store_n(&queue->spin, spin + (target - spin) / 8, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&queue->spun, 1, __ATOMIC_RELAXED);
+            if (queue->stats) {
+                count_blocked(queue, sem, start);
+            }
+            return;
+        }
+    }
+
+    if (spin > 0) {
+        int floor = queue->spin_max < SPIN_MIN ? queue->spin_max : SPIN_MIN;
+        int target = spin / 2 < floor ? floor : spin / 2;
+        __atomic_store_n(&queue->spin, spin + (target - spin) / 8, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&queue->parked, 1, __ATOMIC_RELAXED);
+    sem_wait(sem);
+    if (queue->stats) {
+        count_blocked(queue, sem, start);
+    }
+}
+
+
+/**
+ * Allocate a concurrent queue which also signals an eventfd when it goes
+ * from empty to non-empty, so a thread can wait for items with poll or
+ * epoll alongside sockets and timers, then take them with queue_drain
+ * @param size - The size of memory to allocate to the queue
+ * @return queue - Pointer to the allocated queue
+ */
+Queue *queue_alloc_eventfd(int size) {
+    Queue *queue = queue_alloc(size);
+
+    queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue->event_fd < 0) {
+        handle_error("eventfd");
+    }
     return queue;
 }
 
 
+/**
+ * The eventfd of a queue allocated with queue_alloc_eventfd
+ * @param queue - Pointer to the queue
+ * @return int - The file descriptor, -1 for a plain queue
+ */
+int queue_eventfd(Queue *queue) {
+    return queue->event_fd;
+}
+
+
 /**
  * Free a concurrent queue and associated memory 
  *
@@ -57,11 +340,74 @@ Queue *queue_alloc(int size) {
  */
 void queue_free(Queue *queue) {
     // assert(0 && "not implemented yet!");
+    if (queue->event_fd >= 0) {
+        close(queue->event_fd);
+    }
+    free(queue->stats);
     free(queue->task);
     free(queue);
 }
 
 
+/**
+ * Make the eventfd of a queue readable
+ */
+static void signal_event(Queue *queue) {
+    uint64_t one = 1;
+
+    if (write(queue->event_fd, &one, sizeof one) != sizeof one) {
+        handle_error("eventfd write");
+    }
+}
+
+
+/**
+ * Add items once their spaces were taken from the empty semaphore
+ */
+static void push_items(Queue *queue, void **items, int count) {
+    int signal = 0;
+
+    lock_queue(queue);
+    count_change(queue, count, 0);
+
+    //Increase size and add items into last position
+    for (int i = 0; i < count; ++i) {
+        queue->task[queue->size + i] = items[i];
+    }
+    queue->size += count;
+
+    if (queue->event_fd >= 0) {
+        //Post under the mutex, so a drain which cleared the signal before
+        //this push is sure to find the items
+        for (int i = 0; i < count; ++i) {
+            sem_post(&queue->full);
+        }
+        signal = !queue->signalled;
+        queue->signalled = 1;
+    }
+
+    //After items put into queue, unlock and increase full semaphore
+    pthread_mutex_unlock(&queue->mutex);
+    if (queue->event_fd < 0) {
+        //One unit per item, a waiter only enters the kernel if asleep
+        for (int i = 0; i < count; ++i) {
+            sem_post(&queue->full);
+        }
+    }
+    else if (signal) {
+        signal_event(queue);
+    }
+}
+
+
+/**
+ * Add an item once a space was taken from the empty semaphore
+ */
+static void push_item(Queue *queue, void *item) {
+    push_items(queue, &item, 1);
+}
+
+
 /**
  * Place an item into the concurrent queue.
  * If no space available then queue will block
@@ -77,16 +423,35 @@ void queue_put(Queue *queue, void *item) {
     // assert(0 && "not implemented yet!");
 
     //When there are still have empty for item, decrease empty semaphore
-    sem_wait(&queue->empty);
-    pthread_mutex_lock(&queue->mutex);
+    spin_wait(queue, &queue->empty);
+    push_item(queue, item);
+}
+
 
-    //Increase size and add item into last position
-    queue->task[queue->size] = item;
-    queue->size++;
+/**
+ * Take the first item once one was taken from the full semaphore
+ */
+static void *pop_item(Queue *queue) {
+    lock_queue(queue);
+    count_change(queue, 0, 1);
+
+    //Get the first item in the queue
+    void** task = queue->task[0];
 
-    //After item put into queue, unlock and increase full semaphore
+    //Move each item in the queue forward
+    for(int i = 1; i < queue->size; i++){
+        queue->task[i - 1] = queue->task[i];
+    }
+
+    //Subtract size and set last item into NULL to keep queue data correct 
+    queue->size--;
+    queue->task[queue->size] = NULL;
+
+    //After item get from queue, unlock and increase empty semaphore
     pthread_mutex_unlock(&queue->mutex);
-    sem_post(&queue->full);
+    sem_post(&queue->empty);
+
+    return task;
 }
 
 
@@ -105,25 +470,225 @@ void *queue_get(Queue *queue) {
     // assert(0 && "not implemented yet!");
 
     //When there are still have item for consume, decrease full semaphore
-    sem_wait(&queue->full);
-    pthread_mutex_lock(&queue->mutex);
+    spin_wait(queue, &queue->full);
+    return pop_item(queue);
+}
 
-    //Get the first item in the queue
-    void** task = queue->task[0];
 
-    //Move each item in the queue forward
-    for(int i = 1; i < queue->size; i++){
-        queue->task[i - 1] = queue->task[i];
+/**
+ * Wait on a semaphore for at most a number of milliseconds
+ * @param queue - Pointer to the queue the semaphore belongs to
+ * @param sem - The semaphore
+ * @param timeout_ms - The most milliseconds to wait
+ * @return int - 0 once a unit was taken, -1 on timeout
+ */
+static int sem_wait_timeout(Queue *queue, sem_t *sem, long timeout_ms) {
+    struct timespec deadline;
+    int rc = 0;
+
+    if (sem_trywait(sem) == 0) {
+        return 0;
     }
+    long start = queue->stats ? now_ns() : 0;
 
-    //Subtract size and set last item into NULL to keep queue data correct 
-    queue->size--;
-    queue->task[queue->size] = NULL;
+    //sem_timedwait takes an absolute CLOCK_REALTIME deadline
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
 
-    //After item get from queue, unlock and increase empty semaphore
+    while (sem_timedwait(sem, &deadline) != 0) {
+        if (errno != EINTR) {
+            rc = -1;
+            break;
+        }
+    }
+    if (queue->stats) {
+        count_blocked(queue, sem, start);
+    }
+    return rc;
+}
+
+
+/**
+ * Place an item into the concurrent queue if there is space for it,
+ * without blocking
+ * @param queue - Pointer to the queue to add an item to
+ * @param item - An item to add to queue
+ * @return int - 0 if the item was put, -1 if the queue was full
+ */
+int queue_try_put(Queue *queue, void *item) {
+    if (sem_trywait(&queue->empty) != 0) {
+        return -1;
+    }
+    push_item(queue, item);
+    return 0;
+}
+
+
+/**
+ * Get an item from the concurrent queue if one is available, without
+ * blocking
+ * @param queue - Pointer to queue to get item from
+ * @param item - Where the item is stored. Items may be NULL, so the
+ *               return value tells whether one was got
+ * @return int - 0 if an item was got, -1 if the queue was empty
+ */
+int queue_try_get(Queue *queue, void **item) {
+    if (sem_trywait(&queue->full) != 0) {
+        return -1;
+    }
+    *item = pop_item(queue);
+    return 0;
+}
+
+
+/**
+ * Place an item into the concurrent queue, blocking for at most a
+ * number of milliseconds until there is space for it
+ * @param queue - Pointer to the queue to add an item to
+ * @param item - An item to add to queue
+ * @param timeout_ms - The most milliseconds to wait
+ * @return int - 0 if the item was put, -1 on timeout
+ */
+int queue_put_timeout(Queue *queue, void *item, long timeout_ms) {
+    if (sem_wait_timeout(queue, &queue->empty, timeout_ms) != 0) {
+        return -1;
+    }
+    push_item(queue, item);
+    return 0;
+}
+
+
+/**
+ * Get an item from the concurrent queue, blocking for at most a number
+ * of milliseconds until one is available
+ * @param queue - Pointer to queue to get item from
+ * @param item - Where the item is stored
+ * @param timeout_ms - The most milliseconds to wait
+ * @return int - 0 if an item was got, -1 on timeout
+ */
+int queue_get_timeout(Queue *queue, void **item, long timeout_ms) {
+    if (sem_wait_timeout(queue, &queue->full, timeout_ms) != 0) {
+        return -1;
+    }
+    *item = pop_item(queue);
+    return 0;
+}
+
+
+/**
+ * Take up to count of a semaphore's units, blocking for the first only
+ * @param queue - Pointer to the queue the semaphore belongs to
+ * @param sem - The semaphore
+ * @param count - The most units to take, at least 1
+ * @return int - The number of units taken
+ */
+static int sem_take_many(Queue *queue, sem_t *sem, int count) {
+    int taken = 1;
+
+    spin_wait(queue, sem);
+    while (taken < count && sem_trywait(sem) == 0) {
+        ++taken;
+    }
+    return taken;
+}
+
+
+/**
+ * Place several items into the concurrent queue, in order.
+ * Blocks until there is space for at least one of them, then puts as
+ * many as fit under a single lock and repeats until all are placed.
+ *
+ * @param queue - Pointer to the queue to add the items to
+ * @param items - The items to add
+ * @param count - The number of items
+ */
+void queue_put_many(Queue *queue, void **items, int count) {
+    while (count > 0) {
+        int n = sem_take_many(queue, &queue->empty, count);
+
+        push_items(queue, items, n);
+        items += n;
+        count -= n;
+    }
+}
+
+
+/**
+ * Get several items from the concurrent queue, in order.
+ * Blocks until at least one item is available, then takes as many of
+ * the available ones as fit under a single lock.
+ *
+ * @param queue - Pointer to queue to get items from
+ * @param items - Where the items are stored
+ * @param max - The most items to get
+ * @return int - The number of items got, at least 1
+ */
+int queue_get_many(Queue *queue, void **items, int max) {
+    int n = sem_take_many(queue, &queue->full, max);
+
+    lock_queue(queue);
+    count_change(queue, 0, n);
+    for (int i = 0; i < n; ++i) {
+        items[i] = queue->task[i];
+    }
+
+    //Move the rest forward once for all of them
+    for (int i = n; i < queue->size; i++) {
+        queue->task[i - n] = queue->task[i];
+    }
+    queue->size -= n;
+    for (int i = 0; i < n; ++i) {
+        queue->task[queue->size + i] = NULL;
+    }
     pthread_mutex_unlock(&queue->mutex);
-    sem_post(&queue->empty);
 
-    return task;
+    for (int i = 0; i < n; ++i) {
+        sem_post(&queue->empty);
+    }
+    return n;
 }
 
+
+/**
+ * Take the items of a queue allocated with queue_alloc_eventfd without
+ * blocking, once its eventfd polled readable. The eventfd is left
+ * readable if items may remain, so a later poll returns at once.
+ * @param queue - Pointer to the queue
+ * @param items - Where the items are stored
+ * @param max - The most items to take
+ * @return int - The number of items taken, possibly 0
+ */
+int queue_drain(Queue *queue, void **items, int max) {
+    uint64_t count;
+    int n = 0, signal = 0;
+
+    //Reset the eventfd, then the signal, so any push from here on signals
+    if (read(queue->event_fd, &count, sizeof count) < 0 && errno != EAGAIN) {
+        handle_error("eventfd read");
+    }
+    lock_queue(queue);
+    queue->signalled = 0;
+    pthread_mutex_unlock(&queue->mutex);
+
+    while (n < max && queue_try_get(queue, &items[n]) == 0) {
+        ++n;
+    }
+
+    if (n == max) {
+        lock_queue(queue);
+        signal = queue->size > 0 && !queue->signalled;
+        if (signal) {
+            queue->signalled = 1;
+        }
+        pthread_mutex_unlock(&queue->mutex);
+    }
+    if (signal) {
+        signal_event(queue);
+    }
+    return n;
+}
@@ -10,6 +10,21 @@
 typedef struct QueueStruct Queue;
 
 
+#define QUEUE_DEPTH_BUCKETS 8   //Depths 0, 1, 2-3, 4-7, ..., 64 and over
+
+/*
+ * QueueStats - what a queue did, counted once enabled
+ */
+typedef struct {
+    long puts;
+    long gets;
+    long put_blocked_ns;    //Time threads waited for space to put
+    long get_blocked_ns;    //Time threads waited for items to get
+    long lock_wait_ns;      //Time threads waited for the mutex
+    long depth_ns[QUEUE_DEPTH_BUCKETS];    //Time spent at each depth
+} QueueStats;
+
+
 /**
  * Allocate a concurrent queue of a specific size
  * @param size - The size of memory to allocate to the queue
@@ -18,6 +33,24 @@ typedef struct QueueStruct Queue;
 Queue *queue_alloc(int size);
 
 
+/**
+ * Allocate a concurrent queue which also signals an eventfd when it goes
+ * from empty to non-empty, so a thread can wait for items with poll or
+ * epoll alongside sockets and timers, then take them with queue_drain
+ * @param size - The size of memory to allocate to the queue
+ * @return queue - Pointer to the allocated queue
+ */
+Queue *queue_alloc_eventfd(int size);
+
+
+/**
+ * The eventfd of a queue allocated with queue_alloc_eventfd
+ * @param queue - Pointer to the queue
+ * @return int - The file descriptor, -1 for a plain queue
+ */
+int queue_eventfd(Queue *queue);
+
+
 /**
  * Free a concurrent queue and associated memory 
  *
@@ -30,6 +63,59 @@ Queue *queue_alloc(int size);
 void queue_free(Queue *queue);
 
 
+/**
+ * Set the most polls a thread waiting on the queue spins for before it
+ * sleeps. Within it the queue tunes how long to spin by itself.
+ * By default threads spin only when more than one CPU is online.
+ * @param queue - Pointer to the queue
+ * @param spin_max - The most polls, 0 to sleep at once
+ */
+void queue_set_spin(Queue *queue, int spin_max);
+
+
+/**
+ * How waits on the queue ended so far
+ * @param queue - Pointer to the queue
+ * @param spun - Set to the waits which ended while spinning
+ * @param parked - Set to the waits which had to sleep
+ */
+void queue_spin_stats(Queue *queue, long *spun, long *parked);
+
+
+/**
+ * Start counting puts, gets, blocked time and depth on a queue. Until
+ * then a queue only pays a test of a NULL pointer per call.
+ * @param queue - Pointer to the queue
+ */
+void queue_enable_stats(Queue *queue);
+
+
+/**
+ * Read the counters of a queue
+ * @param queue - Pointer to the queue
+ * @param stats - Where the counters are copied to
+ * @return int - 0 on success, -1 if they were never enabled
+ */
+int queue_stats(Queue *queue, QueueStats *stats);
+
+
+/**
+ * Add the counters of one queue to those of another, e.g. to sum up
+ * queues which do the same job
+ * @param total - The counters added to
+ * @param stats - The counters to add
+ */
+void queue_stats_add(QueueStats *total, const QueueStats *stats);
+
+
+/**
+ * Print the counters of a queue
+ * @param name - What the queue is for
+ * @param stats - The counters
+ */
+void queue_print_stats(const char *name, const QueueStats *stats);
+
+
 /**
  * Place an item into the concurrent queue.
  * If no space available then queue will block
@@ -58,5 +144,86 @@ void queue_put(Queue *queue, void *item);
 void *queue_get(Queue *queue);
 
 
+/**
+ * Place an item into the concurrent queue if there is space for it,
+ * without blocking
+ * @param queue - Pointer to the queue to add an item to
+ * @param item - An item to add to queue
+ * @return int - 0 if the item was put, -1 if the queue was full
+ */
+int queue_try_put(Queue *queue, void *item);
+
+
+/**
+ * Get an item from the concurrent queue if one is available, without
+ * blocking
+ * @param queue - Pointer to queue to get item from
+ * @param item - Where the item is stored. Items may be NULL, so the
+ *               return value tells whether one was got
+ * @return int - 0 if an item was got, -1 if the queue was empty
+ */
+int queue_try_get(Queue *queue, void **item);
+
+
+/**
+ * Place an item into the concurrent queue, blocking for at most a
+ * number of milliseconds until there is space for it
+ * @param queue - Pointer to the queue to add an item to
+ * @param item - An item to add to queue
+ * @param timeout_ms - The most milliseconds to wait
+ * @return int - 0 if the item was put, -1 on timeout
+ */
+int queue_put_timeout(Queue *queue, void *item, long timeout_ms);
+
+
+/**
+ * Get an item from the concurrent queue, blocking for at most a number
+ * of milliseconds until one is available
+ * @param queue - Pointer to queue to get item from
+ * @param item - Where the item is stored
+ * @param timeout_ms - The most milliseconds to wait
+ * @return int - 0 if an item was got, -1 on timeout
+ */
+int queue_get_timeout(Queue *queue, void **item, long timeout_ms);
+
+
+/**
+ * Place several items into the concurrent queue, in order.
+ * Blocks until there is space for at least one of them, then puts as
+ * many as fit under a single lock and repeats until all are placed.
+ *
+ * @param queue - Pointer to the queue to add the items to
+ * @param items - The items to add
+ * @param count - The number of items
+ */
+void queue_put_many(Queue *queue, void **items, int count);
+
+
+/**
+ * Get several items from the concurrent queue, in order.
+ * Blocks until at least one item is available, then takes as many of
+ * the available ones as fit under a single lock.
+ *
+ * @param queue - Pointer to queue to get items from
+ * @param items - Where the items are stored
+ * @param max - The most items to get
+ * @return int - The number of items got, at least 1
+ */
+int queue_get_many(Queue *queue, void **items, int max);
+
+
+
+/**
+ * Take the items of a queue allocated with queue_alloc_eventfd without
+ * blocking, once its eventfd polled readable. The eventfd is left
+ * readable if items may remain, so a later poll returns at once.
+ * @param queue - Pointer to the queue
+ * @param items - Where the items are stored
+ * @param max - The most items to take
+ * @return int - The number of items taken, possibly 0
+ */
+int queue_drain(Queue *queue, void **items, int max);
+
+
 #endif
 
@@ -0,0 +1,553 @@
+#include "ring.h"
+
+#include <semaphore.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+
+/*
+ * A place in a ring. Its sequence says whose turn it is: pos while free
+ * for the put of pos, pos + 1 once that item is in, and pos + capacity
+ * once taken, free for the put one lap later.
+ */
+typedef struct {
+    long sequence;
+    void *item;
+} Cell;
+
+
+/*
+ * Spmc - the semaphores say how many items and free places there are,
+ * so a thread past them only claims a position and never fails
+ */
+typedef struct SpmcStruct {
+    sem_t full;     //Items to get
+    sem_t empty;    //Free places to put into
+    long head;      //Next position to get, claimed atomically by consumers
+    long tail;      //Next position to put, producer only
+    long mask;      //Capacity - 1, the capacity is a power of 2
+    Cell *cells;
+    QueueStats *stats;  //Counters, NULL unless enabled
+    long changed_ns;    //When the depth last changed
+} Spmc;
+
+
+/*
+ * Mpsc - producers wait on a semaphore for a free place, the consumer
+ * waits on the eventfd for items
+ */
+typedef struct MpscStruct {
+    sem_t empty;    //Free places to put into
+    long head;      //Next position to take, consumer only
+    long tail;      //Next position to put, claimed atomically by producers
+    long count;     //Items put and not yet taken, changed atomically
+    long mask;      //Capacity - 1, the capacity is a power of 2
+    Cell *cells;
+    int event_fd;   //Readable while items may be waiting
+    QueueStats *stats;  //Counters, NULL unless enabled
+    long changed_ns;    //When the depth last changed
+} Mpsc;
+
+
+/**
+ * Allocate the cells of a ring
+ * @param size - The most items held at once
+ * @param mask - Set to the capacity, a power of 2 of at least size, - 1
+ * @return cells - The cells, each free for its first put
+ */
+static Cell *alloc_cells(int size, long *mask) {
+    long capacity = 1;
+
+    while (capacity < size) {
+        capacity <<= 1;
+    }
+
+    Cell *cells = (Cell*)malloc(sizeof(Cell) * capacity);
+    for (long i = 0; i < capacity; ++i) {
+        cells[i].sequence = i;
+        cells[i].item = NULL;
+    }
+    *mask = capacity - 1;
+    return cells;
+}
+
+
+/**
+ * Wait for a cell to reach a sequence. The semaphores make sure it is
+ * about to, so this only waits out a thread in the middle of its turn.
+ */
+static void wait_turn(Cell *cell, long sequence) {
+    while (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) != sequence) {
+        sched_yield();
+    }
+}
+
+
+/**
+ * Put an item into the cell of a claimed position
+ */
+static void put_cell(Cell *cells, long mask, long pos, void *item) {
+    Cell *cell = &cells[pos & mask];
+
+    wait_turn(cell, pos);
+    cell->item = item;
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Take the item out of the cell of a claimed position
+ */
+static void *take_cell(Cell *cells, long mask, long pos) {
+    Cell *cell = &cells[pos & mask];
+
+    wait_turn(cell, pos + 1);
+    void *item = cell->item;
+    __atomic_store_n(&cell->sequence, pos + mask + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+
+/**
+ * The monotonic clock in nanoseconds
+ */
+static long now_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+
+/**
+ * The depth histogram bucket of a depth: 0, 1, 2-3, 4-7 and so on
+ */
+static int depth_bucket(long depth) {
+    int bucket = 0;
+
+    while (depth > 0 && bucket < QUEUE_DEPTH_BUCKETS - 1) {
+        depth >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+
+
+/**
+ * Count a change of depth. Without a lock the depth is read as the
+ * change happens, so a little time may land in a neighbouring bucket.
+ */
+static void count_change(QueueStats *stats, long *changed_ns, long depth, int puts, int gets) {
+    long now = now_ns();
+    long elapsed = now - __atomic_exchange_n(changed_ns, now, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&stats->depth_ns[depth_bucket(depth)], elapsed, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->puts, puts, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->gets, gets, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Take a unit of a semaphore, adding the time blocked to blocked_ns
+ * unless it is NULL
+ */
+static void wait_counted(sem_t *sem, long *blocked_ns) {
+    if (blocked_ns == NULL) {
+        sem_wait(sem);
+        return;
+    }
+    if (sem_trywait(sem) == 0) {
+        return;
+    }
+
+    long start = now_ns();
+    sem_wait(sem);
+    __atomic_add_fetch(blocked_ns, now_ns() - start, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Copy counters which threads add to atomically
+ */
+static void copy_stats(QueueStats *stats, QueueStats *from, long changed_ns, long depth) {
+    stats->puts = __atomic_load_n(&from->puts, __ATOMIC_RELAXED);
+    stats->gets = __atomic_load_n(&from->gets, __ATOMIC_RELAXED);
+    stats->put_blocked_ns = __atomic_load_n(&from->put_blocked_ns, __ATOMIC_RELAXED);
+    stats->get_blocked_ns = __atomic_load_n(&from->get_blocked_ns, __ATOMIC_RELAXED);
+    stats->lock_wait_ns = 0;
+    for (int i = 0; i < QUEUE_DEPTH_BUCKETS; ++i) {
+        stats->depth_ns[i] = __atomic_load_n(&from->depth_ns[i], __ATOMIC_RELAXED);
+    }
+    stats->depth_ns[depth_bucket(depth)] += now_ns() - changed_ns;
+}
+
+
+/**
+ * Wait on a semaphore for at most a number of milliseconds
+ * @param sem - The semaphore
+ * @param timeout_ms - The most milliseconds to wait
+ * @return int - 0 once a unit was taken, -1 on timeout
+ */
+static int sem_wait_timeout(sem_t *sem, long timeout_ms) {
+    struct timespec deadline;
+
+    //sem_timedwait takes an absolute CLOCK_REALTIME deadline
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    while (sem_timedwait(sem, &deadline) != 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * Allocate a single producer queue
+ * @param size - The most items held at once, rounded up to a power of 2
+ * @return queue - Pointer to the allocated queue
+ */
+Spmc *spmc_alloc(int size) {
+    Spmc *queue = (Spmc*)malloc(sizeof(Spmc));
+    queue->cells = alloc_cells(size, &queue->mask);
+    queue->head = 0;
+    queue->tail = 0;
+    sem_init(&queue->full, 0, 0);
+    sem_init(&queue->empty, 0, queue->mask + 1);
+    queue->stats = NULL;
+
+    return queue;
+}
+
+
+/**
+ * The items in a single producer queue, give or take those being put
+ */
+static long spmc_depth(Spmc *queue) {
+    int depth;
+
+    sem_getvalue(&queue->full, &depth);
+    return depth < 0 ? 0 : depth;
+}
+
+
+/**
+ * Start counting puts, gets, blocked time and depth on a single producer
+ * queue, as for a Queue. There is no mutex to wait for.
+ * @param queue - Pointer to the queue
+ */
+void spmc_enable_stats(Spmc *queue) {
+    queue->changed_ns = now_ns();
+    queue->stats = (QueueStats*)calloc(1, sizeof(QueueStats));
+}
+
+
+/**
+ * Read the counters of a single producer queue
+ * @param queue - Pointer to the queue
+ * @param stats - Where the counters are copied to
+ * @return int - 0 on success, -1 if they were never enabled
+ */
+int spmc_stats(Spmc *queue, QueueStats *stats) {
+    if (queue->stats == NULL) {
+        return -1;
+    }
+    copy_stats(stats, queue->stats, __atomic_load_n(&queue->changed_ns, __ATOMIC_RELAXED), spmc_depth(queue));
+    return 0;
+}
+
+
+/**
+ * Free a single producer queue
+ *
+ * Don't call this function while the queue is still in use.
+ *
+ * @param queue - Pointer to the queue to free
+ */
+void spmc_free(Spmc *queue) {
+    sem_destroy(&queue->full);
+    sem_destroy(&queue->empty);
+    free(queue->stats);
+    free(queue->cells);
+    free(queue);
+}
+
+
+/**
+ * Place an item into the queue, blocking until there is space.
+ * Only ever called by the one producer.
+ * @param queue - Pointer to the queue
+ * @param item - An item to add to queue
+ */
+void spmc_put(Spmc *queue, void *item) {
+    wait_counted(&queue->empty, queue->stats ? &queue->stats->put_blocked_ns : NULL);
+    if (queue->stats) {
+        count_change(queue->stats, &queue->changed_ns, spmc_depth(queue), 1, 0);
+    }
+
+    //The only producer, so the tail needs no atomic
+    put_cell(queue->cells, queue->mask, queue->tail++, item);
+    sem_post(&queue->full);
+}
+
+
+/**
+ * Place several items into the queue, in order. Blocks until there is
+ * space for at least one of them, then publishes as many as fit at once
+ * and repeats until all are placed. Only ever called by the one producer.
+ * @param queue - Pointer to the queue
+ * @param items - The items to add
+ * @param count - The number of items
+ */
+void spmc_put_many(Spmc *queue, void **items, int count) {
+    while (count > 0) {
+        int n = 1;
+
+        //Wait for one place, then take whatever else is free without waiting
+        wait_counted(&queue->empty, queue->stats ? &queue->stats->put_blocked_ns : NULL);
+        while (n < count && sem_trywait(&queue->empty) == 0) {
+            ++n;
+        }
+        if (queue->stats) {
+            count_change(queue->stats, &queue->changed_ns, spmc_depth(queue), n, 0);
+        }
+
+        for (int i = 0; i < n; ++i) {
+            put_cell(queue->cells, queue->mask, queue->tail++, items[i]);
+        }
+        for (int i = 0; i < n; ++i) {
+            sem_post(&queue->full);
+        }
+        items += n;
+        count -= n;
+    }
+}
+
+
+/**
+ * Take an item once one was taken from the full semaphore
+ */
+static void *spmc_take(Spmc *queue) {
+    if (queue->stats) {
+        count_change(queue->stats, &queue->changed_ns, spmc_depth(queue) + 1, 0, 1);
+    }
+    long pos = __atomic_fetch_add(&queue->head, 1, __ATOMIC_RELAXED);
+    void *item = take_cell(queue->cells, queue->mask, pos);
+
+    sem_post(&queue->empty);
+    return item;
+}
+
+
+/**
+ * Get the oldest item, blocking until one is available
+ * @param queue - Pointer to the queue
+ * @return item - The item
+ */
+void *spmc_get(Spmc *queue) {
+    wait_counted(&queue->full, queue->stats ? &queue->stats->get_blocked_ns : NULL);
+    return spmc_take(queue);
+}
+
+
+/**
+ * Get the oldest item if one is available, without blocking
+ * @param queue - Pointer to the queue
+ * @param item - Where the item is stored
+ * @return int - 0 if an item was got, -1 if the queue was empty
+ */
+int spmc_try_get(Spmc *queue, void **item) {
+    if (sem_trywait(&queue->full) != 0) {
+        return -1;
+    }
+    *item = spmc_take(queue);
+    return 0;
+}
+
+
+/**
+ * Get the oldest item, blocking for at most a number of milliseconds
+ * @param queue - Pointer to the queue
+ * @param item - Where the item is stored
+ * @param timeout_ms - The most milliseconds to wait
+ * @return int - 0 if an item was got, -1 on timeout
+ */
+int spmc_get_timeout(Spmc *queue, void **item, long timeout_ms) {
+    long start = queue->stats ? now_ns() : 0;
+    int rc = sem_wait_timeout(&queue->full, timeout_ms);
+
+    if (queue->stats) {
+        __atomic_add_fetch(&queue->stats->get_blocked_ns, now_ns() - start, __ATOMIC_RELAXED);
+    }
+    if (rc != 0) {
+        return -1;
+    }
+    *item = spmc_take(queue);
+    return 0;
+}
+
+
+/**
+ * Allocate a single consumer queue
+ * @param size - The most items held at once, rounded up to a power of 2
+ * @return queue - Pointer to the allocated queue
+ */
+Mpsc *mpsc_alloc(int size) {
+    Mpsc *queue = (Mpsc*)malloc(sizeof(Mpsc));
+    queue->cells = alloc_cells(size, &queue->mask);
+    queue->head = 0;
+    queue->tail = 0;
+    queue->count = 0;
+    sem_init(&queue->empty, 0, queue->mask + 1);
+
+    queue->stats = NULL;
+
+    queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue->event_fd < 0) {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
+    return queue;
+}
+
+
+/**
+ * Start counting puts, gets, blocked time and depth on a single consumer
+ * queue, as for a Queue. The consumer never blocks in the queue itself,
+ * it waits on the eventfd.
+ * @param queue - Pointer to the queue
+ */
+void mpsc_enable_stats(Mpsc *queue) {
+    queue->changed_ns = now_ns();
+    queue->stats = (QueueStats*)calloc(1, sizeof(QueueStats));
+}
+
+
+/**
+ * Read the counters of a single consumer queue
+ * @param queue - Pointer to the queue
+ * @param stats - Where the counters are copied to
+ * @return int - 0 on success, -1 if they were never enabled
+ */
+int mpsc_stats(Mpsc *queue, QueueStats *stats) {
+    if (queue->stats == NULL) {
+        return -1;
+    }
+    long depth = __atomic_load_n(&queue->count, __ATOMIC_RELAXED);
+    copy_stats(stats, queue->stats, __atomic_load_n(&queue->changed_ns, __ATOMIC_RELAXED), depth < 0 ? 0 : depth);
+    return 0;
+}
+
+
+/**
+ * Free a single consumer queue
+ *
+ * Don't call this function while the queue is still in use.
+ *
+ * @param queue - Pointer to the queue to free
+ */
+void mpsc_free(Mpsc *queue) {
+    close(queue->event_fd);
+    sem_destroy(&queue->empty);
+    free(queue->stats);
+    free(queue->cells);
+    free(queue);
+}
+
+
+/**
+ * Make the eventfd of a queue readable
+ */
+static void mpsc_signal(Mpsc *queue) {
+    uint64_t one = 1;
+
+    if (write(queue->event_fd, &one, sizeof one) != sizeof one) {
+        perror("eventfd write");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/**
+ * Place an item into the queue, blocking until there is space
+ * @param queue - Pointer to the queue
+ * @param item - An item to add to queue
+ */
+void mpsc_put(Mpsc *queue, void *item) {
+    wait_counted(&queue->empty, queue->stats ? &queue->stats->put_blocked_ns : NULL);
+
+    long pos = __atomic_fetch_add(&queue->tail, 1, __ATOMIC_RELAXED);
+    put_cell(queue->cells, queue->mask, pos, item);
+
+    //Only the put which finds the queue empty wakes the consumer
+    long depth = __atomic_fetch_add(&queue->count, 1, __ATOMIC_ACQ_REL);
+    if (depth == 0) {
+        mpsc_signal(queue);
+    }
+    if (queue->stats) {
+        count_change(queue->stats, &queue->changed_ns, depth < 0 ? 0 : depth, 1, 0);
+    }
+}
+
+
+/**
+ * The eventfd which polls readable while the queue may hold items
+ * @param queue - Pointer to the queue
+ * @return int - The file descriptor
+ */
+int mpsc_eventfd(Mpsc *queue) {
+    return queue->event_fd;
+}
+
+
+/**
+ * Take the oldest items without blocking, once the eventfd polled
+ * readable. The eventfd is left readable if items may remain.
+ * Only ever called by the one consumer.
+ * @param queue - Pointer to the queue
+ * @param items - Where the items are stored
+ * @param max - The most items to take
+ * @return int - The number of items taken, possibly 0
+ */
+int mpsc_drain(Mpsc *queue, void **items, int max) {
+    uint64_t signals;
+    int n = 0;
+
+    if (read(queue->event_fd, &signals, sizeof signals) < 0 && errno != EAGAIN) {
+        perror("eventfd read");
+        exit(EXIT_FAILURE);
+    }
+
+    //The only consumer, so the head needs no atomic
+    while (n < max) {
+        Cell *cell = &queue->cells[queue->head & queue->mask];
+        if (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) != queue->head + 1) {
+            break;
+        }
+        items[n++] = take_cell(queue->cells, queue->mask, queue->head++);
+        sem_post(&queue->empty);
+    }
+
+    //Items left, or being put, were counted while the eventfd was signalled
+    long left = __atomic_sub_fetch(&queue->count, n, __ATOMIC_ACQ_REL);
+    if (left > 0) {
+        mpsc_signal(queue);
+    }
+    if (queue->stats && n > 0) {
+        count_change(queue->stats, &queue->changed_ns, left + n, 0, n);
+    }
+    return n;
+}
@@ -0,0 +1,172 @@
+#ifndef RING_H
+#define RING_H
+
+#include "queue.h"
+
+
+/*
+ * Spmc - a bounded queue with a single producer and any number of
+ * consumers. Blocks like Queue, but without a mutex: the producer
+ * publishes with plain stores, consumers claim items with an atomic add.
+ * The implementation is hidden from the outside.
+ */
+typedef struct SpmcStruct Spmc;
+
+
+/*
+ * Mpsc - a bounded queue with any number of producers and a single
+ * consumer, which waits for items on an eventfd signalled when the queue
+ * becomes non-empty and then drains it. Producers claim places with an
+ * atomic add, the consumer takes items with plain stores.
+ * The implementation is hidden from the outside.
+ */
+typedef struct MpscStruct Mpsc;
+
+
+/**
+ * Allocate a single producer queue
+ * @param size - The most items held at once, rounded up to a power of 2
+ * @return queue - Pointer to the allocated queue
+ */
+Spmc *spmc_alloc(int size);
+
+
+/**
+ * Free a single producer queue
+ *
+ * Don't call this function while the queue is still in use.
+ *
+ * @param queue - Pointer to the queue to free
+ */
+void spmc_free(Spmc *queue);
+
+
+/**
+ * Place an item into the queue, blocking until there is space.
+ * Only ever called by the one producer.
+ * @param queue - Pointer to the queue
+ * @param item - An item to add to queue
+ */
+void spmc_put(Spmc *queue, void *item);
+
+
+/**
+ * Place several items into the queue, in order. Blocks until there is
+ * space for at least one of them, then publishes as many as fit at once
+ * and repeats until all are placed. Only ever called by the one producer.
+ * @param queue - Pointer to the queue
+ * @param items - The items to add
+ * @param count - The number of items
+ */
+void spmc_put_many(Spmc *queue, void **items, int count);
+
+
+/**
+ * Get the oldest item, blocking until one is available
+ * @param queue - Pointer to the queue
+ * @return item - The item
+ */
+void *spmc_get(Spmc *queue);
+
+
+/**
+ * Get the oldest item if one is available, without blocking
+ * @param queue - Pointer to the queue
+ * @param item - Where the item is stored
+ * @return int - 0 if an item was got, -1 if the queue was empty
+ */
+int spmc_try_get(Spmc *queue, void **item);
+
+
+/**
+ * Get the oldest item, blocking for at most a number of milliseconds
+ * @param queue - Pointer to the queue
+ * @param item - Where the item is stored
+ * @param timeout_ms - The most milliseconds to wait
+ * @return int - 0 if an item was got, -1 on timeout
+ */
+int spmc_get_timeout(Spmc *queue, void **item, long timeout_ms);
+
+
+/**
+ * Start counting puts, gets, blocked time and depth on a single producer
+ * queue, as for a Queue. There is no mutex to wait for.
+ * @param queue - Pointer to the queue
+ */
+void spmc_enable_stats(Spmc *queue);
+
+
+/**
+ * Read the counters of a single producer queue
+ * @param queue - Pointer to the queue
+ * @param stats - Where the counters are copied to
+ * @return int - 0 on success, -1 if they were never enabled
+ */
+int spmc_stats(Spmc *queue, QueueStats *stats);
+
+
+/**
+ * Allocate a single consumer queue
+ * @param size - The most items held at once, rounded up to a power of 2
+ * @return queue - Pointer to the allocated queue
+ */
+Mpsc *mpsc_alloc(int size);
+
+
+/**
+ * Free a single consumer queue
+ *
+ * Don't call this function while the queue is still in use.
+ *
+ * @param queue - Pointer to the queue to free
+ */
+void mpsc_free(Mpsc *queue);
+
+
+/**
+ * Place an item into the queue, blocking until there is space
+ * @param queue - Pointer to the queue
+ * @param item - An item to add to queue
+ */
+void mpsc_put(Mpsc *queue, void *item);
+
+
+/**
+ * The eventfd which polls readable while the queue may hold items
+ * @param queue - Pointer to the queue
+ * @return int - The file descriptor
+ */
+int mpsc_eventfd(Mpsc *queue);
+
+
+/**
+ * Take the oldest items without blocking, once the eventfd polled
+ * readable. The eventfd is left readable if items may remain.
+ * Only ever called by the one consumer.
+ * @param queue - Pointer to the queue
+ * @param items - Where the items are stored
+ * @param max - The most items to take
+ * @return int - The number of items taken, possibly 0
+ */
+int mpsc_drain(Mpsc *queue, void **items, int max);
+
+
+/**
+ * Start counting puts, gets, blocked time and depth on a single consumer
+ * queue, as for a Queue. The consumer never blocks in the queue itself,
+ * it waits on the eventfd.
+ * @param queue - Pointer to the queue
+ */
+void mpsc_enable_stats(Mpsc *queue);
+
+
+/**
+ * Read the counters of a single consumer queue
+ * @param queue - Pointer to the queue
+ * @param stats - Where the counters are copied to
+ * @return int - 0 on success, -1 if they were never enabled
+ */
+int mpsc_stats(Mpsc *queue, QueueStats *stats);
+
+
+#endif
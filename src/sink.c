@@ -0,0 +1,212 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "sink.h"
+
+
+/*
+ * Sink - an output file which chunks are written into at their offsets.
+ */
+typedef struct SinkStruct {
+    int fd;
+    int direct_fd;  //Same file opened O_DIRECT for SINK_DIRECT, else -1
+    int mode;
+    long size;
+    char *map;      //Shared mapping of the whole file for SINK_MMAP
+} Sink;
+
+
+/**
+ * Write all of a buffer at an offset, retrying short writes
+ * @return int - 0 on success, -1 on failure
+ */
+static int pwrite_all(int fd, const char *data, size_t length, long offset) {
+    while (length > 0) {
+        ssize_t written = pwrite(fd, data, length, offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        offset += written;
+        length -= written;
+    }
+    return 0;
+}
+
+
+/**
+ * Create (or truncate) the output file, preallocate it to its full size
+ * and prepare it for writing in the given mode
+ * @param path - The file to write
+ * @param size - The final size of the file in bytes
+ * @param mode - How bytes are written e.g. SINK_MMAP
+ * @return sink - Pointer to the sink or NULL on failure
+ */
+Sink *sink_open(const char *path, long size, int mode) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "error writing to: %s\n", path);
+        return NULL;
+    }
+
+    //Reserve the blocks up front, falling back where fallocate is missing
+    if (size > 0 && fallocate(fd, 0, 0, size) != 0) {
+        if ((errno != EOPNOTSUPP && errno != ENOSYS) || ftruncate(fd, size) != 0) {
+            perror("fallocate");
+            close(fd);
+            return NULL;
+        }
+    }
+
+    Sink *sink = (Sink*)malloc(sizeof(Sink));
+    sink->fd = fd;
+    sink->direct_fd = -1;
+    sink->mode = mode;
+    sink->size = size;
+    sink->map = NULL;
+
+    //Filesystems without O_DIRECT (e.g. tmpfs) fall back to buffered writes
+    if (mode == SINK_DIRECT) {
+        sink->direct_fd = open(path, O_WRONLY | O_DIRECT);
+        if (sink->direct_fd < 0) {
+            fprintf(stderr, "O_DIRECT not supported for %s, writing buffered\n", path);
+            sink->mode = SINK_BUFFERED;
+        }
+    }
+
+    if (mode == SINK_MMAP && size > 0) {
+        sink->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (sink->map == MAP_FAILED) {
+            perror("mmap");
+            close(fd);
+            free(sink);
+            return NULL;
+        }
+    }
+
+    return sink;
+}
+
+
+/**
+ * Get the memory backing a position in a SINK_MMAP file. Bytes stored
+ * there become the file's contents, so a chunk can be received directly
+ * into place.
+ * @param sink - The sink
+ * @param offset - The position in the file
+ * @return char* - Pointer to the byte at offset
+ */
+char *sink_region(Sink *sink, long offset) {
+    return sink->map + offset;
+}
+
+
+/**
+ * Write bytes at a position in the file. For SINK_DIRECT, a write from
+ * aligned memory at an aligned offset goes out with O_DIRECT up to its
+ * last aligned byte, and only its unaligned tail goes through the page
+ * cache. A write at an unaligned offset goes through the page cache
+ * whole, so callers write an unaligned head on its own first.
+ * For SINK_BUFFERED, writeback of the bytes is started straight away.
+ * @param sink - The sink
+ * @param offset - The position in the file
+ * @param data - The bytes to write
+ * @param length - The number of bytes
+ * @return int - 0 on success, -1 on failure
+ */
+int sink_write(Sink *sink, long offset, const char *data, size_t length) {
+    if (sink->mode == SINK_MMAP) {
+        memcpy(sink->map + offset, data, length);
+        return 0;
+    }
+
+    if (sink->mode == SINK_DIRECT && offset % SINK_ALIGN == 0
+        && (uintptr_t)data % SINK_ALIGN == 0) {
+        size_t aligned = length - length % SINK_ALIGN;
+
+        if (aligned > 0 && pwrite_all(sink->direct_fd, data, aligned, offset) != 0) {
+            perror("pwrite");
+            return -1;
+        }
+        data += aligned;
+        offset += aligned;
+        length -= aligned;
+    }
+
+    if (length > 0 && pwrite_all(sink->fd, data, length, offset) != 0) {
+        perror("pwrite");
+        return -1;
+    }
+
+    //Start writeback without waiting, so dirty pages never pile up
+    if (sink->mode == SINK_BUFFERED && length > 0) {
+        sync_file_range(sink->fd, offset, length, SYNC_FILE_RANGE_WRITE);
+    }
+    return 0;
+}
+
+
+/**
+ * Mark a region of the file as complete: wait for the writeback that
+ * sink_write started on it and drop its pages from the page cache, so a
+ * large download neither fills memory with dirty pages nor stalls on
+ * flushing all of them at the end. Does nothing for SINK_MMAP.
+ * @param sink - The sink
+ * @param offset - The position of the region in the file
+ * @param length - The length of the region in bytes
+ */
+void sink_release(Sink *sink, long offset, size_t length) {
+    if (sink->mode == SINK_MMAP || length == 0) {
+        return;
+    }
+
+    //Only clean pages can be dropped, so finish writing them out first
+    sync_file_range(sink->fd, offset, length,
+        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(sink->fd, offset, length, POSIX_FADV_DONTNEED);
+}
+
+
+/**
+ * Flush everything written to the file and free the sink
+ * @param sink - The sink to close
+ * @return int - 0 on success, -1 if the data could not be flushed
+ */
+int sink_close(Sink *sink) {
+    int rc = 0;
+
+    if (sink->map) {
+        if (msync(sink->map, sink->size, MS_SYNC) != 0) {
+            perror("msync");
+            rc = -1;
+        }
+        munmap(sink->map, sink->size);
+    }
+
+    //Heads and tails of SINK_DIRECT went through the page cache
+    if (sink->direct_fd >= 0) {
+        if (fdatasync(sink->fd) != 0) {
+            perror("fdatasync");
+            rc = -1;
+        }
+        close(sink->direct_fd);
+    }
+
+    if (close(sink->fd) != 0) {
+        rc = -1;
+    }
+    free(sink);
+
+    return rc;
+}
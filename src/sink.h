@@ -0,0 +1,80 @@
+#ifndef SINK_H
+#define SINK_H
+
+
+#include <stddef.h>
+
+// How downloaded bytes reach the output file
+#define SINK_BUFFERED 0 // pwrite through the page cache
+#define SINK_MMAP 1     // Preallocated file mapped shared, received into in place
+#define SINK_DIRECT 2   // Aligned blocks written with O_DIRECT, bypassing the page cache
+
+#define SINK_ALIGN 4096 // Alignment of offsets, lengths and memory for O_DIRECT
+
+
+/*
+ * Sink - an output file which chunks are written into at their offsets.
+ * The implementation is hidden from the outside.
+ */
+typedef struct SinkStruct Sink;
+
+
+/**
+ * Create (or truncate) the output file, preallocate it to its full size
+ * and prepare it for writing in the given mode
+ * @param path - The file to write
+ * @param size - The final size of the file in bytes
+ * @param mode - How bytes are written e.g. SINK_MMAP
+ * @return sink - Pointer to the sink or NULL on failure
+ */
+Sink *sink_open(const char *path, long size, int mode);
+
+
+/**
+ * Get the memory backing a position in a SINK_MMAP file. Bytes stored
+ * there become the file's contents, so a chunk can be received directly
+ * into place.
+ * @param sink - The sink
+ * @param offset - The position in the file
+ * @return char* - Pointer to the byte at offset
+ */
+char *sink_region(Sink *sink, long offset);
+
+
+/**
+ * Write bytes at a position in the file. For SINK_DIRECT, a write from
+ * aligned memory at an aligned offset goes out with O_DIRECT up to its
+ * last aligned byte, and only its unaligned tail goes through the page
+ * cache. A write at an unaligned offset goes through the page cache
+ * whole, so callers write an unaligned head on its own first.
+ * For SINK_BUFFERED, writeback of the bytes is started straight away.
+ * @param sink - The sink
+ * @param offset - The position in the file
+ * @param data - The bytes to write
+ * @param length - The number of bytes
+ * @return int - 0 on success, -1 on failure
+ */
+int sink_write(Sink *sink, long offset, const char *data, size_t length);
+
+
+/**
+ * Mark a region of the file as complete: wait for the writeback that
+ * sink_write started on it and drop its pages from the page cache, so a
+ * large download neither fills memory with dirty pages nor stalls on
+ * flushing all of them at the end. Does nothing for SINK_MMAP.
+ * @param sink - The sink
+ * @param offset - The position of the region in the file
+ * @param length - The length of the region in bytes
+ */
+void sink_release(Sink *sink, long offset, size_t length);
+
+
+/**
+ * Flush everything written to the file and free the sink
+ * @param sink - The sink to close
+ * @return int - 0 on success, -1 if the data could not be flushed
+ */
+int sink_close(Sink *sink);
+
+
+#endif
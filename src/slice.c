@@ -0,0 +1,102 @@
+#include "slice.h"
+
+#include <stdlib.h>
+
+
+/*
+ * Segment - a reference counted block of received bytes.
+ */
+typedef struct SegmentStruct {
+    char *memory;
+    int references;                 //Changed atomically from any thread
+    segment_release_fn release;
+    void *arg;
+} Segment;
+
+
+/**
+ * Wrap memory into a segment holding one reference, the caller's
+ * @param memory - The memory, owned by the segment from now on
+ * @param release - Called to dispose of the memory
+ * @param arg - Passed to release, e.g. the pool the memory came from
+ * @return segment - Pointer to the segment
+ */
+Segment *segment_new(char *memory, segment_release_fn release, void *arg) {
+    Segment *segment = (Segment*)malloc(sizeof(Segment));
+    segment->memory = memory;
+    segment->references = 1;
+    segment->release = release;
+    segment->arg = arg;
+
+    return segment;
+}
+
+
+/**
+ * Drop a reference to a segment, releasing it if it was the last
+ * @param segment - Pointer to the segment
+ */
+void segment_release(Segment *segment) {
+    if (__atomic_sub_fetch(&segment->references, 1, __ATOMIC_ACQ_REL) == 0) {
+        segment->release(segment->arg, segment->memory);
+        free(segment);
+    }
+}
+
+
+/**
+ * Take a slice of a segment
+ * @param segment - Pointer to the segment
+ * @param data - The first byte of the slice, inside the segment
+ * @param length - The number of bytes
+ * @return Slice - The slice, holding a new reference
+ */
+Slice segment_slice(Segment *segment, char *data, size_t length) {
+    Slice slice = { segment, data, length };
+
+    __atomic_add_fetch(&segment->references, 1, __ATOMIC_RELAXED);
+    return slice;
+}
+
+
+/**
+ * Take a slice of part of a slice, sharing its segment
+ * @param slice - The slice
+ * @param offset - Where the part starts within the slice
+ * @param length - The number of bytes, clipped to the end of the slice
+ * @return Slice - The part, holding a new reference
+ */
+Slice slice_sub(const Slice *slice, size_t offset, size_t length) {
+    if (offset > slice->length) {
+        offset = slice->length;
+    }
+    if (length > slice->length - offset) {
+        length = slice->length - offset;
+    }
+    return segment_slice(slice->segment, slice->data + offset, length);
+}
+
+
+/**
+ * Copy a slice, taking a new reference
+ * @param slice - The slice
+ * @return Slice - The copy
+ */
+Slice slice_ref(const Slice *slice) {
+    return segment_slice(slice->segment, slice->data, slice->length);
+}
+
+
+/**
+ * Drop a slice's reference and empty it. Releasing an empty slice does
+ * nothing.
+ * @param slice - The slice
+ */
+void slice_release(Slice *slice) {
+    if (slice->segment) {
+        segment_release(slice->segment);
+    }
+    slice->segment = NULL;
+    slice->data = NULL;
+    slice->length = 0;
+}
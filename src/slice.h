@@ -0,0 +1,85 @@
+#ifndef SLICE_H
+#define SLICE_H
+
+#include <stddef.h>
+
+
+/*
+ * Segment - a reference counted block of received bytes. The memory is
+ * handed back through a release function once the last reference to it
+ * is dropped, so stages can share it without copying.
+ * The implementation is hidden from the outside.
+ */
+typedef struct SegmentStruct Segment;
+
+
+/*
+ * Slice - a view of some bytes of a segment which holds a reference to
+ * it. Copy one with slice_ref, never by assignment, so each copy is
+ * released on its own.
+ */
+typedef struct {
+    Segment *segment;   //NULL for an empty slice holding nothing
+    char *data;
+    size_t length;
+} Slice;
+
+
+// Called with the memory of a segment once nothing refers to it
+typedef void (*segment_release_fn)(void *arg, char *memory);
+
+
+/**
+ * Wrap memory into a segment holding one reference, the caller's
+ * @param memory - The memory, owned by the segment from now on
+ * @param release - Called to dispose of the memory
+ * @param arg - Passed to release, e.g. the pool the memory came from
+ * @return segment - Pointer to the segment
+ */
+Segment *segment_new(char *memory, segment_release_fn release, void *arg);
+
+
+/**
+ * Drop a reference to a segment, releasing it if it was the last
+ * @param segment - Pointer to the segment
+ */
+void segment_release(Segment *segment);
+
+
+/**
+ * Take a slice of a segment
+ * @param segment - Pointer to the segment
+ * @param data - The first byte of the slice, inside the segment
+ * @param length - The number of bytes
+ * @return Slice - The slice, holding a new reference
+ */
+Slice segment_slice(Segment *segment, char *data, size_t length);
+
+
+/**
+ * Take a slice of part of a slice, sharing its segment
+ * @param slice - The slice
+ * @param offset - Where the part starts within the slice
+ * @param length - The number of bytes, clipped to the end of the slice
+ * @return Slice - The part, holding a new reference
+ */
+Slice slice_sub(const Slice *slice, size_t offset, size_t length);
+
+
+/**
+ * Copy a slice, taking a new reference
+ * @param slice - The slice
+ * @return Slice - The copy
+ */
+Slice slice_ref(const Slice *slice);
+
+
+/**
+ * Drop a slice's reference and empty it. Releasing an empty slice does
+ * nothing.
+ * @param slice - The slice
+ */
+void slice_release(Slice *slice);
+
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef TYPED_QUEUE_H
+#define TYPED_QUEUE_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdlib.h>
+
+
+/*
+ * DEFINE_QUEUE(Name, Type) - define a concurrent queue which holds Type
+ * values by copy in a ring, so nothing has to be allocated per item.
+ * It blocks like Queue, and defines:
+ *
+ *   Name *Name##_alloc(int size);
+ *   void Name##_free(Name *queue);
+ *   void Name##_put(Name *queue, const Type *item);   copies item in
+ *   void Name##_get(Name *queue, Type *item);         copies the oldest out
+ *   int Name##_try_get(Name *queue, Type *item);      0, or -1 if empty
+ *
+ * Use it at file scope, once per Name.
+ */
+#define DEFINE_QUEUE(Name, Type)                                            \
+                                                                            \
+typedef struct Name##Struct {                                               \
+    sem_t full;                 /* Items to get */                          \
+    sem_t empty;                /* Free places to put into */               \
+    Type *items;                /* Ring of size items */                    \
+    int size;                                                               \
+    int head;                   /* Oldest item */                           \
+    int count;                                                              \
+    pthread_mutex_t mutex;      /* Protects the ring */                     \
+} Name;                                                                     \
+                                                                            \
+static inline Name *Name##_alloc(int size) {                                \
+    Name *queue = (Name*)malloc(sizeof(Name));                              \
+    queue->items = (Type*)malloc(sizeof(Type) * size);                      \
+    queue->size = size;                                                     \
+    queue->head = 0;                                                        \
+    queue->count = 0;                                                       \
+    sem_init(&queue->full, 0, 0);                                           \
+    sem_init(&queue->empty, 0, size);                                       \
+    pthread_mutex_init(&queue->mutex, NULL);                                \
+    return queue;                                                           \
+}                                                                           \
+                                                                            \
+static inline void Name##_free(Name *queue) {                               \
+    sem_destroy(&queue->full);                                              \
+    sem_destroy(&queue->empty);                                             \
+    pthread_mutex_destroy(&queue->mutex);                                   \
+    free(queue->items);                                                     \
+    free(queue);                                                            \
+}                                                                           \
+                                                                            \
+static inline void Name##_put(Name *queue, const Type *item) {              \
+    sem_wait(&queue->empty);                                                \
+    pthread_mutex_lock(&queue->mutex);                                      \
+    queue->items[(queue->head + queue->count) % queue->size] = *item;       \
+    queue->count++;                                                         \
+    pthread_mutex_unlock(&queue->mutex);                                    \
+    sem_post(&queue->full);                                                 \
+}                                                                           \
+                                                                            \
+static inline void Name##_get(Name *queue, Type *item) {                    \
+    sem_wait(&queue->full);                                                 \
+    pthread_mutex_lock(&queue->mutex);                                      \
+    *item = queue->items[queue->head];                                      \
+    queue->head = (queue->head + 1) % queue->size;                          \
+    queue->count--;                                                         \
+    pthread_mutex_unlock(&queue->mutex);                                    \
+    sem_post(&queue->empty);                                                \
+}                                                                           \
+                                                                            \
+static inline int Name##_try_get(Name *queue, Type *item) {                 \
+    if (sem_trywait(&queue->full) != 0) {                                   \
+        return -1;                                                          \
+    }                                                                       \
+    pthread_mutex_lock(&queue->mutex);                                      \
+    *item = queue->items[queue->head];                                      \
+    queue->head = (queue->head + 1) % queue->size;                          \
+    queue->count--;                                                         \
+    pthread_mutex_unlock(&queue->mutex);                                    \
+    sem_post(&queue->empty);                                                \
+    return 0;                                                               \
+}
+
+
+#endif
@@ -0,0 +1,462 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "http.h"
+#include "uring.h"
+
+#define URING_BUF_SIZE (64 * 1024)  //Registered receive buffer per connection
+#define HEADER_SIZE 8192            //Most header bytes kept per connection
+
+//Operation in flight, kept in the low bits of user_data
+#define OP_SEND 0
+#define OP_RECV 1
+#define OP_WRITE 2
+
+
+// The mapped submission and completion rings of an io_uring instance
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_tail_local;     //Tail including SQEs not yet submitted
+    unsigned to_submit;
+
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size, sqes_size;
+} Ring;
+
+
+// One ranged GET and where its body goes in the file
+typedef struct {
+    int sockfd;
+    char *request;
+    char range[64];             //The range asked for, "" for the whole file
+    char header[HEADER_SIZE];
+    size_t header_length;
+    int header_done;
+    long file_offset;           //Where the next body byte is written
+    long end;                   //Offset past the range, -1 until a whole file's length is known
+    size_t writing;             //Length of the write linked to the next receive
+    int active;
+} UringConn;
+
+
+/**
+ * Create an io_uring instance and map its rings
+ * @param ring - The ring to set up
+ * @param entries - The number of submission queue entries
+ * @param syscalls - Incremented by the number of system calls made
+ * @return int - 0 on success, -1 on failure
+ */
+static int ring_setup(Ring *ring, unsigned entries, long *syscalls) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+    memset(ring, 0, sizeof *ring);
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    ++*syscalls;
+    if (ring->fd < 0) {
+        perror("io_uring_setup");
+        return -1;
+    }
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    //Newer kernels map both rings with one mmap
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size) {
+            ring->sq_size = ring->cq_size;
+        }
+        ring->cq_size = ring->sq_size;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ++*syscalls;
+    if (ring->sq_ptr == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    }else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        ++*syscalls;
+        if (ring->cq_ptr == MAP_FAILED) {
+            perror("mmap");
+            return -1;
+        }
+    }
+
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    ++*syscalls;
+    if (ring->sqes == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    char *sq = ring->sq_ptr, *cq = ring->cq_ptr;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->sq_tail_local = *ring->sq_tail;
+
+    return 0;
+}
+
+
+/**
+ * Unmap the rings and close an io_uring instance
+ * @param ring - The ring to tear down
+ * @param syscalls - Incremented by the number of system calls made
+ */
+static void ring_free(Ring *ring, long *syscalls) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_size);
+        ++*syscalls;
+    }
+    munmap(ring->sq_ptr, ring->sq_size);
+    close(ring->fd);
+    *syscalls += 3;
+}
+
+
+/**
+ * Take the next free submission queue entry, cleared
+ * @param ring - The ring to submit to
+ * @return The entry, queued with the next ring_enter
+ */
+static struct io_uring_sqe *ring_get_sqe(Ring *ring) {
+    unsigned index = ring->sq_tail_local & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof *sqe);
+    ring->sq_array[index] = index;
+    ++ring->sq_tail_local;
+    ++ring->to_submit;
+
+    return sqe;
+}
+
+
+/**
+ * Submit queued entries and wait for at least one completion, in one
+ * system call
+ * @param ring - The ring to submit to
+ * @param syscalls - Incremented by the number of system calls made
+ * @return int - 0 on success, -1 on failure
+ */
+static int ring_enter(Ring *ring, long *syscalls) {
+    __atomic_store_n(ring->sq_tail, ring->sq_tail_local, __ATOMIC_RELEASE);
+
+    int rc;
+    do {
+        rc = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1,
+            IORING_ENTER_GETEVENTS, NULL, 0);
+        ++*syscalls;
+    } while (rc < 0 && errno == EINTR);
+
+    if (rc < 0) {
+        perror("io_uring_enter");
+        return -1;
+    }
+    ring->to_submit -= rc;
+    return 0;
+}
+
+
+/**
+ * Queue a receive into a connection's registered buffer
+ */
+static void queue_recv(Ring *ring, char *buffers, int index, int sockfd, unsigned flags) {
+    struct io_uring_sqe *sqe = ring_get_sqe(ring);
+
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = sockfd;
+    sqe->addr = (unsigned long)(buffers + (size_t)index * URING_BUF_SIZE);
+    sqe->len = URING_BUF_SIZE;
+    sqe->off = -1;
+    sqe->buf_index = index;
+    sqe->flags = flags;
+    sqe->user_data = (unsigned long)index << 2 | OP_RECV;
+}
+
+
+/**
+ * Queue a write of received body bytes at their offset in the file,
+ * linked to the receive which reuses the buffer after it
+ */
+static void queue_write(Ring *ring, int index, int file_fd, char *data, size_t length, long offset) {
+    struct io_uring_sqe *sqe = ring_get_sqe(ring);
+
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = file_fd;
+    sqe->addr = (unsigned long)data;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->buf_index = index;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = (unsigned long)index << 2 | OP_WRITE;
+}
+
+
+/**
+ * Handle a completed receive: find the body after the header, then
+ * write it out and receive again, or retire the connection at EOF
+ * @return int - The number of operations queued
+ */
+static int handle_recv(Ring *ring, UringConn *conn, char *buffers, int index,
+    int file_fd, int res, long *failed) {
+    char *buffer = buffers + (size_t)index * URING_BUF_SIZE;
+    char *body = buffer;
+    size_t body_length = res;
+
+    if (res <= 0) {
+        if (res < 0 || !conn->header_done) {
+            fprintf(stderr, "error downloading range %d: %s\n", index, strerror(-res));
+            *failed = 1;
+        }else if (conn->end >= 0 && conn->file_offset != conn->end) {
+            //The server closed before the whole range came
+            fprintf(stderr, "range %d ended at %ld of %ld\n", index, conn->file_offset, conn->end);
+            *failed = 1;
+        }
+        conn->active = 0;
+        return 0;
+    }
+
+    //The header may span receives, so gather it until it ends
+    if (!conn->header_done) {
+        size_t room = HEADER_SIZE - 1 - conn->header_length;
+        size_t copied = body_length < room ? body_length : room;
+        size_t old_length = conn->header_length;
+
+        memcpy(conn->header + conn->header_length, buffer, copied);
+        conn->header_length += copied;
+        conn->header[conn->header_length] = '\0';
+
+        char *header_end = strstr(conn->header, "\r\n\r\n");
+        if (header_end == NULL) {
+            if (conn->header_length == HEADER_SIZE - 1) {
+                fprintf(stderr, "response header too long for range %d\n", index);
+                *failed = 1;
+                conn->active = 0;
+                return 0;
+            }
+            queue_recv(ring, buffers, index, conn->sockfd, 0);
+            return 1;
+        }
+
+        Buffer response = { conn->header, header_end + 4 - conn->header };
+        int status = http_get_status(&response);
+        if (!http_status_matches(status, conn->range)
+            || strcasestr(conn->header, "Transfer-Encoding: chunked")) {
+            fprintf(stderr, "unexpected response for range %d: %d\n", index, status);
+            *failed = 1;
+            conn->active = 0;
+            return 0;
+        }
+
+        //Without a range the length is only known from the header
+        if (conn->end < 0) {
+            long size = http_get_resource_size(&response);
+            conn->end = size >= 0 ? conn->file_offset + size : -1;
+        }
+
+        conn->header_done = 1;
+        body = buffer + (response.length - old_length);
+        body_length = res - (response.length - old_length);
+    }
+
+    if (body_length > 0) {
+        queue_write(ring, index, file_fd, body, body_length, conn->file_offset);
+        conn->writing = body_length;
+        conn->file_offset += body_length;
+        queue_recv(ring, buffers, index, conn->sockfd, 0);
+        return 2;
+    }
+
+    queue_recv(ring, buffers, index, conn->sockfd, 0);
+    return 1;
+}
+
+
+/**
+ * Download byte ranges of a url straight into a file, driving every
+ * connection from the calling thread with io_uring. Each connection
+ * receives into its own registered buffer and every receive is followed
+ * by a write of its body bytes at the range's offset in the file, linked
+ * to the next receive into the same buffer. Completions of all
+ * connections are reaped and new work submitted with one system call.
+ *
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * @param path - The file to write, created or truncated
+ * @param min_ranges - The first byte of each range
+ * @param max_ranges - The last byte of each range, -1 for the whole file
+ *                     asked for without a range
+ * @param count - The number of ranges, one connection each
+ * @param syscalls - Incremented by the number of system calls made
+ * @return long - The body bytes written or -1 on failure, including a
+ *                range which ended early
+ */
+long uring_download(const char *url, const char *path, long *min_ranges,
+    long *max_ranges, int count, long *syscalls) {
+    char host[1024];
+    long written = 0, failed = 0;
+    int in_flight = 0, active = count;
+    Ring ring;
+
+    //Step1: split the url like http_url does
+    char *page = http_split_url(url, host, sizeof host);
+    if (page == NULL) {
+        return -1;
+    }
+
+    int file_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ++*syscalls;
+    if (file_fd < 0) {
+        fprintf(stderr, "error writing to: %s\n", path);
+        return -1;
+    }
+
+    //Step2: a ring big enough for a send, write and receive per connection
+    unsigned entries = 8;
+    while (entries < (unsigned)count * 4) {
+        entries *= 2;
+    }
+    if (ring_setup(&ring, entries, syscalls) != 0) {
+        close(file_fd);
+        return -1;
+    }
+
+    //Step3: one registered receive buffer per connection
+    char *buffers = mmap(NULL, (size_t)count * URING_BUF_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    struct iovec *iovecs = malloc(sizeof(struct iovec) * count);
+    for (int i = 0; i < count; ++i) {
+        iovecs[i].iov_base = buffers + (size_t)i * URING_BUF_SIZE;
+        iovecs[i].iov_len = URING_BUF_SIZE;
+    }
+    *syscalls += 2;
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iovecs, count) < 0) {
+        perror("io_uring_register");
+        failed = 1;
+        active = 0;
+    }
+
+    //Step4: connect, then queue each request linked to its first receive
+    UringConn *conns = calloc(count, sizeof(UringConn));
+    for (int i = 0; i < count && !failed; ++i) {
+        conns[i].sockfd = client_socket(host, 80);
+        *syscalls += 2;
+        if (max_ranges[i] < 0) {
+            conns[i].range[0] = '\0';
+        }else {
+            snprintf(conns[i].range, sizeof conns[i].range, "%ld-%ld", min_ranges[i], max_ranges[i]);
+        }
+        conns[i].request = pack_http_request(host, page, conns[i].range, GET);
+        conns[i].file_offset = min_ranges[i];
+        conns[i].end = max_ranges[i] < 0 ? -1 : max_ranges[i] + 1;
+        conns[i].active = 1;
+
+        struct io_uring_sqe *sqe = ring_get_sqe(&ring);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conns[i].sockfd;
+        sqe->addr = (unsigned long)conns[i].request;
+        sqe->len = strlen(conns[i].request);
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = (unsigned long)i << 2 | OP_SEND;
+
+        queue_recv(&ring, buffers, i, conns[i].sockfd, 0);
+        in_flight += 2;
+    }
+
+    //Step5: reap completions and queue follow-up work until all are done
+    while ((active > 0 || in_flight > 0) && ring_enter(&ring, syscalls) == 0) {
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; ++head) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            int index = cqe->user_data >> 2;
+            int res = cqe->res;
+            UringConn *conn = &conns[index];
+            --in_flight;
+
+            switch (cqe->user_data & 3) {
+            case OP_SEND:
+                if (res < 0) {
+                    fprintf(stderr, "error sending request %d: %s\n", index, strerror(-res));
+                    failed = 1;
+                }
+                break;
+
+            case OP_WRITE:
+                //A short write breaks the link, so its remainder is never written
+                if (res < 0 || (size_t)res != conn->writing) {
+                    fprintf(stderr, "error writing to: %s\n", path);
+                    failed = 1;
+                }else {
+                    written += res;
+                }
+                break;
+
+            case OP_RECV:
+                //A receive cancelled by a failed or short link leaves its range incomplete
+                if (res == -ECANCELED || !conn->active) {
+                    if (conn->active && res == -ECANCELED) {
+                        fprintf(stderr, "error downloading range %d: %s\n", index, strerror(-res));
+                        failed = 1;
+                    }
+                    conn->active = 0;
+                }else {
+                    in_flight += handle_recv(&ring, conn, buffers, index, file_fd, res, &failed);
+                }
+
+                if (!conn->active) {
+                    close(conn->sockfd);
+                    ++*syscalls;
+                    --active;
+                }
+                break;
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    for (int i = 0; i < count; ++i) {
+        free(conns[i].request);
+    }
+    free(conns);
+    free(iovecs);
+    munmap(buffers, (size_t)count * URING_BUF_SIZE);
+    ring_free(&ring, syscalls);
+    close(file_fd);
+    *syscalls += 2;
+
+    return failed ? -1 : written;
+}
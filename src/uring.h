@@ -0,0 +1,27 @@
+#ifndef URING_H
+#define URING_H
+
+
+/**
+ * Download byte ranges of a url straight into a file, driving every
+ * connection from the calling thread with io_uring. Each connection
+ * receives into its own registered buffer and every receive is followed
+ * by a write of its body bytes at the range's offset in the file, linked
+ * to the next receive into the same buffer. Completions of all
+ * connections are reaped and new work submitted with one system call.
+ *
+ * @param url - Webpage url e.g. learn.canterbury.ac.nz/profile
+ * @param path - The file to write, created or truncated
+ * @param min_ranges - The first byte of each range
+ * @param max_ranges - The last byte of each range, -1 for the whole file
+ *                     asked for without a range
+ * @param count - The number of ranges, one connection each
+ * @param syscalls - Incremented by the number of system calls made
+ * @return long - The body bytes written or -1 on failure, including a
+ *                range which ended early
+ */
+long uring_download(const char *url, const char *path, long *min_ranges,
+    long *max_ranges, int count, long *syscalls);
+
+
+#endif
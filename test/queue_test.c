@@ -1,72 +1,771 @@
+/*
+ * Correctness checks of the queues followed by a benchmark matrix.
+ *
+ * usage: ./queue_test [-f csv|json] [-i impls] [-p producers] [-c consumers]
+ *                     [-s capacities] [-n items] [-b batch] [-x]
+ *
+ * Every list is comma separated and the matrix runs each implementation
+ * over every combination, skipping the ones it does not support, e.g.
+ * more than one producer on spmc. The checks report on stderr and the
+ * results go to stdout, one row or object per run, so a baseline can be
+ * kept and compared against after a queue change. -x skips the checks,
+ * and the exit status is 1 if any check failed or any run lost or
+ * duplicated an item. The Queue rows also report how many waits ended
+ * spinning and how many parked.
+ */
 #include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/resource.h>
 
 #include "queue.h"
+#include "pqueue.h"
+#include "deque.h"
+#include "ring.h"
+#include "typed_queue.h"
 
-#define NUM_THREADS 16
-#define N 1000000
+#define CHECK_THREADS 16
+#define CHECK_ITEMS 1000000
+#define MAX_THREADS 256
+#define MAX_VALUES 16   //Entries of each swept list
+#define MAX_BATCH 1024
 
 typedef struct {
     int value;
 } Task;
 
 
-void *doSum(void *arg) {
-    int sum = 0;
-    Queue *queue = (Queue*)arg;
+/**
+ * Rank tasks by value, with the NULL stop markers after every task
+ */
+int compare_tasks(const void *a, const void *b) {
+    if (a == NULL || b == NULL) {
+        return (a == NULL) - (b == NULL);
+    }
+    return ((const Task*)a)->value - ((const Task*)b)->value;
+}
 
-    Task *task = (Task*)queue_get(queue);
-    while (task) {
-        sum += task->value;
-        free(task);
 
-        task = (Task*)queue_get(queue);
+/**
+ * Check a priority queue hands items out in rank order, not put order
+ * @return int - 0 if it did, -1 if not
+ */
+int check_priority(void) {
+    PQueue *queue = pqueue_alloc(CHECK_THREADS, compare_tasks);
+    Task tasks[CHECK_THREADS];
+    int ordered = 1;
+
+    for (int i = 0; i < CHECK_THREADS; ++i) {
+        tasks[i].value = (i * 7) % CHECK_THREADS;     //A permutation of 0..15
+        pqueue_put(queue, &tasks[i]);
+    }
+    for (int i = 0; i < CHECK_THREADS; ++i) {
+        Task *task = (Task*)pqueue_get(queue);
+        ordered = ordered && task->value == i;
     }
+    pqueue_free(queue);
 
-    pthread_exit((void*)(intptr_t)sum);
+    fprintf(stderr, "priority order: %s\n", ordered ? "ok" : "FAILED");
+    return ordered ? 0 : -1;
 }
 
 
+/**
+ * Report one check on stderr
+ * @return int - 0 if it passed, -1 if not
+ */
+static int report(const char *name, int passed) {
+    fprintf(stderr, "%s: %s\n", name, passed ? "ok" : "FAILED");
+    return passed ? 0 : -1;
+}
 
-int main(int argc, char **argv) {
 
-    int i, sum;
+/**
+ * Check the non-blocking and timed calls on an empty and a full queue
+ * @return int - 0 if all behaved, -1 if any did not
+ */
+int check_timeouts(void) {
+    struct timespec start, end;
+    Queue *queue = queue_alloc(1);
+    void *item;
+    int value = 42, failed = 0;
 
-    pthread_t thread[NUM_THREADS];
-    Queue *queue = queue_alloc(NUM_THREADS);
+    failed |= report("try_get on empty", queue_try_get(queue, &item) == -1);
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int timed_out = queue_get_timeout(queue, &item, 50) == -1;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long waited = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    fprintf(stderr, "get_timeout on empty: %s after %ld ms\n", timed_out && waited >= 49 ? "ok" : "FAILED", waited);
+    failed |= timed_out && waited >= 49 ? 0 : -1;
 
-    for (i = 0; i < NUM_THREADS; ++i) {
-        pthread_create(&thread[i], NULL, doSum, queue);
-    }
+    failed |= report("try_put on empty", queue_try_put(queue, &value) == 0);
+    failed |= report("try_put on full", queue_try_put(queue, &value) == -1);
+    failed |= report("put_timeout on full", queue_put_timeout(queue, &value, 50) == -1);
+    failed |= report("get_timeout on full", queue_get_timeout(queue, &item, 50) == 0 && item == &value);
+
+    queue_free(queue);
+    return failed ? -1 : 0;
+}
 
-    int expected = 0;
-    for (i = 0; i < N; ++i) {
+
+void *produce(void *arg) {
+    Queue *queue = (Queue*)arg;
+
+    for (int i = 0; i < CHECK_ITEMS / CHECK_THREADS; ++i) {
         Task *task = (Task*)malloc(sizeof(Task));
         task->value = i;
+        queue_put(queue, task);
+    }
+    return NULL;
+}
 
 
+/**
+ * Collect items from CHECK_THREADS producers by polling the eventfd of the
+ * queue and draining it, as an event loop would
+ * @return int - 0 if every item came, -1 if not
+ */
+int check_eventfd(void) {
+    pthread_t thread[CHECK_THREADS];
+    Queue *queue = queue_alloc_eventfd(CHECK_THREADS);
+    struct pollfd ready = { queue_eventfd(queue), POLLIN, 0 };
+    void *tasks[CHECK_THREADS];
+    long sum = 0, expected = 0, wakeups = 0;
+    int received = 0, total = CHECK_ITEMS / CHECK_THREADS * CHECK_THREADS;
 
-        queue_put(queue, task);
+    for (int i = 0; i < CHECK_THREADS; ++i) {
+        pthread_create(&thread[i], NULL, produce, queue);
+        expected += (long)(CHECK_ITEMS / CHECK_THREADS) * (CHECK_ITEMS / CHECK_THREADS - 1) / 2;
+    }
+
+    while (received < total) {
+        if (poll(&ready, 1, 1000) <= 0) {
+            fprintf(stderr, "eventfd: FAILED, no signal with %d items left\n", total - received);
+            exit(1);
+        }
+        ++wakeups;
+
+        int n = queue_drain(queue, tasks, CHECK_THREADS);
+        for (int i = 0; i < n; ++i) {
+            sum += ((Task*)tasks[i])->value;
+            free(tasks[i]);
+        }
+        received += n;
+    }
+
+    for (int i = 0; i < CHECK_THREADS; ++i) {
+        pthread_join(thread[i], NULL);
+    }
+    queue_free(queue);
+
+    fprintf(stderr, "eventfd: %s, sum %ld of %ld over %ld wakeups\n",
+        sum == expected ? "ok" : "FAILED", sum, expected, wakeups);
+    return sum == expected ? 0 : -1;
+}
+
+
+typedef struct {
+    Deque *deque;
+    int stop;
+    long sum;
+    long count;
+    long lost;
+} Thief;
+
+
+void *steal(void *arg) {
+    Thief *thief = (Thief*)arg;
+
+    while (!__atomic_load_n(&thief->stop, __ATOMIC_ACQUIRE)) {
+        int lost = 0;
+        Task *task = (Task*)deque_steal(thief->deque, &lost);
+        if (task) {
+            thief->sum += task->value;
+            ++thief->count;
+        }
+        thief->lost += lost;
+    }
+    return NULL;
+}
+
+
+/**
+ * Push CHECK_ITEMS tasks into a deque, popping every other one back, while the
+ * other threads steal from it; every task has to be taken exactly once
+ * @return int - 0 if it was, -1 if not
+ */
+int check_deque(void) {
+    pthread_t thread[CHECK_THREADS - 1];
+    Thief thieves[CHECK_THREADS - 1];
+    Deque *deque = deque_alloc(CHECK_THREADS * 4);
+    Task *tasks = (Task*)malloc(sizeof(Task) * CHECK_ITEMS);
+    long sum = 0, count = 0, expected = 0, lost = 0;
+
+    for (int i = 0; i < CHECK_THREADS - 1; ++i) {
+        thieves[i] = (Thief){ deque, 0, 0, 0, 0 };
+        pthread_create(&thread[i], NULL, steal, &thieves[i]);
+    }
+
+    for (int i = 0; i < CHECK_ITEMS; ++i) {
+        tasks[i].value = i;
         expected += i;
+        while (deque_push(deque, &tasks[i]) != 0) {
+            //Full, take one back to make room
+            Task *task = (Task*)deque_pop(deque);
+            if (task) {
+                sum += task->value;
+                ++count;
+            }
+        }
+        if (i % 2) {
+            Task *task = (Task*)deque_pop(deque);
+            if (task) {
+                sum += task->value;
+                ++count;
+            }
+        }
+    }
+    Task *task;
+    while ((task = (Task*)deque_pop(deque)) != NULL) {
+        sum += task->value;
+        ++count;
+    }
+
+    for (int i = 0; i < CHECK_THREADS - 1; ++i) {
+        __atomic_store_n(&thieves[i].stop, 1, __ATOMIC_RELEASE);
+        pthread_join(thread[i], NULL);
+        sum += thieves[i].sum;
+        count += thieves[i].count;
+        lost += thieves[i].lost;
+    }
+    deque_free(deque);
+    free(tasks);
+
+    fprintf(stderr, "deque: %s, %ld of %d tasks, sum %ld of %ld, %ld steals lost\n",
+        count == CHECK_ITEMS && sum == expected ? "ok" : "FAILED", count, CHECK_ITEMS, sum, expected, lost);
+    return count == CHECK_ITEMS && sum == expected ? 0 : -1;
+}
+
+
+
+/*
+ * Item - what the benchmark passes, stamped when it is put so the
+ * consumer can tell how long the hand-off took. A negative value stops
+ * a consumer.
+ */
+typedef struct {
+    long value;
+    long put_ns;
+} Item;
+
+DEFINE_QUEUE(ItemQueue, Item)
+
+
+/*
+ * Impl - one queue implementation driven through the same calls. put
+ * passes count items, get copies out up to max and returns how many.
+ */
+typedef struct {
+    const char *name;
+    int max_producers;      //0 for any number
+    int max_consumers;
+    int batched;            //Moves up to batch items per call
+    void *(*alloc)(int capacity);
+    void (*free)(void *queue);
+    void (*put)(void *queue, Item **items, int count);
+    int (*get)(void *queue, Item *items, int max);
+    void (*spin_stats)(void *queue, long *spun, long *parked);     //NULL if it does not spin
+} Impl;
+
+
+typedef struct {
+    long producers, consumers, capacity, items, batch;
+    double seconds;
+    long p50_ns, p99_ns, p999_ns;
+    long switches;
+    long spun, parked;      //Waits which ended spinning and which slept
+    int ok;
+} Result;
+
+
+static long now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+
+//The baseline parks at once, queue_alloc would spin by default
+static void *queue_bench_alloc(int capacity) {
+    Queue *queue = queue_alloc(capacity);
+    queue_set_spin(queue, 0);
+    return queue;
+}
+
+static void *queue_spin_bench_alloc(int capacity) {
+    Queue *queue = queue_alloc(capacity);
+    queue_set_spin(queue, 4096);
+    return queue;
+}
+
+static void queue_bench_free(void *queue) {
+    queue_free((Queue*)queue);
+}
+
+static void queue_bench_spin_stats(void *queue, long *spun, long *parked) {
+    queue_spin_stats((Queue*)queue, spun, parked);
+}
+
+static void queue_bench_put(void *queue, Item **items, int count) {
+    if (count == 1) {
+        queue_put((Queue*)queue, items[0]);
     }
+    else {
+        queue_put_many((Queue*)queue, (void**)items, count);
+    }
+}
 
+static int queue_bench_get(void *queue, Item *items, int max) {
+    void *taken[MAX_BATCH];
+    int n = 1;
 
-    for (i = 0; i < NUM_THREADS; ++i) {
-        queue_put(queue, NULL);
+    if (max == 1) {
+        taken[0] = queue_get((Queue*)queue);
+    }
+    else {
+        n = queue_get_many((Queue*)queue, taken, max);
     }
+    for (int i = 0; i < n; ++i) {
+        items[i] = *(Item*)taken[i];
+    }
+    return n;
+}
+
 
-    intptr_t value;
-    sum = 0;
-    for (i = 0; i < NUM_THREADS; ++i) {
-        pthread_join(thread[i], (void**)&value);
-        sum += value;
+/**
+ * Rank items by value, with the stop markers after every item
+ */
+static int compare_items(const void *a, const void *b) {
+    long x = ((const Item*)a)->value, y = ((const Item*)b)->value;
+    if (x < 0 || y < 0) {
+        return (x < 0) - (y < 0);
     }
+    return (x > y) - (x < y);
+}
 
-    queue_free(queue);
+static void *pqueue_bench_alloc(int capacity) {
+    return pqueue_alloc(capacity, compare_items);
+}
+
+static void pqueue_bench_free(void *queue) {
+    pqueue_free((PQueue*)queue);
+}
+
+static void pqueue_bench_put(void *queue, Item **items, int count) {
+    pqueue_put((PQueue*)queue, items[0]);
+}
+
+static int pqueue_bench_get(void *queue, Item *items, int max) {
+    items[0] = *(Item*)pqueue_get((PQueue*)queue);
+    return 1;
+}
+
+
+static void *spmc_bench_alloc(int capacity) {
+    return spmc_alloc(capacity);
+}
+
+static void spmc_bench_free(void *queue) {
+    spmc_free((Spmc*)queue);
+}
+
+static void spmc_bench_put(void *queue, Item **items, int count) {
+    if (count == 1) {
+        spmc_put((Spmc*)queue, items[0]);
+    }
+    else {
+        spmc_put_many((Spmc*)queue, (void**)items, count);
+    }
+}
 
-    printf("total sum: %d, expected sum: %d\n", (int)sum, expected);
+static int spmc_bench_get(void *queue, Item *items, int max) {
+    items[0] = *(Item*)spmc_get((Spmc*)queue);
+    return 1;
+}
+
+
+static void *mpsc_bench_alloc(int capacity) {
+    return mpsc_alloc(capacity);
+}
+
+static void mpsc_bench_free(void *queue) {
+    mpsc_free((Mpsc*)queue);
+}
+
+static void mpsc_bench_put(void *queue, Item **items, int count) {
+    for (int i = 0; i < count; ++i) {
+        mpsc_put((Mpsc*)queue, items[i]);
+    }
+}
+
+/**
+ * Wait on the eventfd and drain, as the main thread of the downloader does
+ */
+static int mpsc_bench_get(void *queue, Item *items, int max) {
+    void *taken[MAX_BATCH];
+    struct pollfd ready = { mpsc_eventfd((Mpsc*)queue), POLLIN, 0 };
+    int n;
+
+    while ((n = mpsc_drain((Mpsc*)queue, taken, max)) == 0) {
+        poll(&ready, 1, -1);
+    }
+    for (int i = 0; i < n; ++i) {
+        items[i] = *(Item*)taken[i];
+    }
+    return n;
+}
+
+
+static void *typed_bench_alloc(int capacity) {
+    return ItemQueue_alloc(capacity);
+}
+
+static void typed_bench_free(void *queue) {
+    ItemQueue_free((ItemQueue*)queue);
+}
+
+static void typed_bench_put(void *queue, Item **items, int count) {
+    ItemQueue_put((ItemQueue*)queue, items[0]);
+}
+
+static int typed_bench_get(void *queue, Item *items, int max) {
+    ItemQueue_get((ItemQueue*)queue, &items[0]);
+    return 1;
+}
+
+
+static const Impl impls[] = {
+    { "queue", 0, 0, 0, queue_bench_alloc, queue_bench_free, queue_bench_put, queue_bench_get,
+        queue_bench_spin_stats },
+    { "queue_spin", 0, 0, 0, queue_spin_bench_alloc, queue_bench_free, queue_bench_put, queue_bench_get,
+        queue_bench_spin_stats },
+    { "queue_many", 0, 0, 1, queue_bench_alloc, queue_bench_free, queue_bench_put, queue_bench_get,
+        queue_bench_spin_stats },
+    { "pqueue", 0, 0, 0, pqueue_bench_alloc, pqueue_bench_free, pqueue_bench_put, pqueue_bench_get, NULL },
+    { "spmc", 1, 0, 0, spmc_bench_alloc, spmc_bench_free, spmc_bench_put, spmc_bench_get, NULL },
+    { "spmc_many", 1, 0, 1, spmc_bench_alloc, spmc_bench_free, spmc_bench_put, spmc_bench_get, NULL },
+    { "mpsc", 0, 1, 1, mpsc_bench_alloc, mpsc_bench_free, mpsc_bench_put, mpsc_bench_get, NULL },
+    { "typed", 0, 0, 0, typed_bench_alloc, typed_bench_free, typed_bench_put, typed_bench_get, NULL },
+};
+
+
+typedef struct {
+    const Impl *impl;
+    void *queue;
+    Item *items;        //Every item of the run, indexed by value
+    long *latency;      //Hand-off time of each item, indexed by value
+    uint64_t *seen;     //Bit per item, set by the consumer which received it
+    long start, end;    //The items a producer puts
+    int batch;
+    long repeats;       //Items a consumer received which had already been seen
+} Worker;
+
+
+void *bench_produce(void *arg) {
+    Worker *worker = (Worker*)arg;
+    Item *pending[MAX_BATCH];
+
+    for (long i = worker->start; i < worker->end; i += worker->batch) {
+        int n = worker->end - i < worker->batch ? worker->end - i : worker->batch;
+        long stamp = now_ns();
+        for (int j = 0; j < n; ++j) {
+            pending[j] = &worker->items[i + j];
+            pending[j]->put_ns = stamp;
+        }
+        worker->impl->put(worker->queue, pending, n);
+    }
+    return NULL;
+}
+
+
+void *bench_consume(void *arg) {
+    Worker *worker = (Worker*)arg;
+    Item taken[MAX_BATCH];
+
+    for (;;) {
+        int n = worker->impl->get(worker->queue, taken, worker->batch);
+        long stamp = now_ns();
+
+        for (int i = 0; i < n; ++i) {
+            if (taken[i].value < 0) {
+                //Only stop markers follow, put back the ones meant for the other consumers
+                Item *stops[MAX_BATCH];
+                for (int j = i + 1; j < n; ++j) {
+                    stops[j - i - 1] = &worker->items[-1];
+                }
+                if (i + 1 < n) {
+                    worker->impl->put(worker->queue, stops, n - i - 1);
+                }
+                return NULL;
+            }
+            long value = taken[i].value;
+            uint64_t bit = (uint64_t)1 << (value % 64);
+            worker->latency[value] = stamp - taken[i].put_ns;
+            if (__atomic_fetch_or(&worker->seen[value / 64], bit, __ATOMIC_RELAXED) & bit) {
+                ++worker->repeats;
+            }
+        }
+    }
+}
+
+
+static int compare_longs(const void *a, const void *b) {
+    long x = *(const long*)a, y = *(const long*)b;
+    return (x > y) - (x < y);
+}
+
+
+/**
+ * Pass items from producers to consumers through one implementation and
+ * measure the throughput and the spread of hand-off times
+ * @param impl - The implementation
+ * @param result - The run to make, its measurements are filled in
+ */
+void bench(const Impl *impl, Result *result) {
+    pthread_t producers[MAX_THREADS], consumers[MAX_THREADS];
+    Worker workers[MAX_THREADS * 2];
+    struct rusage before, after;
+    long items = result->items;
+    int batch = impl->batched ? result->batch : 1;
+
+    //items[-1] is the stop marker
+    Item *all = (Item*)malloc(sizeof(Item) * (items + 1)) + 1;
+    long *latency = (long*)calloc(items, sizeof(long));
+    uint64_t *seen = (uint64_t*)calloc((items + 63) / 64, sizeof(uint64_t));
+    all[-1].value = -1;
+    for (long i = 0; i < items; ++i) {
+        all[i].value = i;
+    }
+
+    void *queue = impl->alloc(result->capacity);
+
+    getrusage(RUSAGE_SELF, &before);
+    long start = now_ns();
+
+    for (int i = 0; i < result->consumers; ++i) {
+        Worker *worker = &workers[result->producers + i];
+        *worker = (Worker){ impl, queue, all, latency, seen, 0, 0, batch, 0 };
+        pthread_create(&consumers[i], NULL, bench_consume, worker);
+    }
+    for (int i = 0; i < result->producers; ++i) {
+        Worker *worker = &workers[i];
+        *worker = (Worker){ impl, queue, all, latency, seen,
+            items * i / result->producers, items * (i + 1) / result->producers, batch, 0 };
+        pthread_create(&producers[i], NULL, bench_produce, worker);
+    }
+
+    for (int i = 0; i < result->producers; ++i) {
+        pthread_join(producers[i], NULL);
+    }
+    //The producers are done, so this thread is the only one putting now
+    Item *stop = &all[-1];
+    for (int i = 0; i < result->consumers; ++i) {
+        impl->put(queue, &stop, 1);
+    }
+
+    long repeats = 0;
+    for (int i = 0; i < result->consumers; ++i) {
+        pthread_join(consumers[i], NULL);
+        repeats += workers[result->producers + i].repeats;
+    }
+
+    long end = now_ns();
+    getrusage(RUSAGE_SELF, &after);
+    if (impl->spin_stats) {
+        impl->spin_stats(queue, &result->spun, &result->parked);
+    }
+    impl->free(queue);
+
+    //Every item has to have arrived, and none twice
+    long received = 0;
+    for (long i = 0; i < (items + 63) / 64; ++i) {
+        received += __builtin_popcountll(seen[i]);
+    }
+
+    qsort(latency, items, sizeof(long), compare_longs);
+    result->seconds = (end - start) / 1e9;
+    result->p50_ns = latency[items / 2];
+    result->p99_ns = latency[items * 99 / 100];
+    result->p999_ns = latency[items * 999 / 1000];
+    result->switches = (after.ru_nvcsw - before.ru_nvcsw) + (after.ru_nivcsw - before.ru_nivcsw);
+    result->ok = received == items && repeats == 0;
+
+    free(all - 1);
+    free(latency);
+    free(seen);
+}
+
+
+/**
+ * Print one run as a CSV row or a JSON object
+ */
+void print_result(const char *format, const Impl *impl, const Result *result, int first) {
+    double rate = result->items / result->seconds;
+
+    if (strcmp(format, "json") == 0) {
+        printf("%s  {\"impl\": \"%s\", \"producers\": %ld, \"consumers\": %ld, \"capacity\": %ld, "
+            "\"items\": %ld, \"batch\": %ld, \"seconds\": %.6f, \"items_per_sec\": %.0f, "
+            "\"p50_ns\": %ld, \"p99_ns\": %ld, \"p999_ns\": %ld, \"switches\": %ld, "
+            "\"spun\": %ld, \"parked\": %ld, \"ok\": %s}",
+            first ? "" : ",\n", impl->name, result->producers, result->consumers, result->capacity,
+            result->items, impl->batched ? result->batch : 1, result->seconds, rate,
+            result->p50_ns, result->p99_ns, result->p999_ns, result->switches,
+            result->spun, result->parked, result->ok ? "true" : "false");
+    }
+    else {
+        if (first) {
+            printf("impl,producers,consumers,capacity,items,batch,seconds,items_per_sec,"
+                "p50_ns,p99_ns,p999_ns,switches,spun,parked,ok\n");
+        }
+        printf("%s,%ld,%ld,%ld,%ld,%ld,%.6f,%.0f,%ld,%ld,%ld,%ld,%ld,%ld,%d\n",
+            impl->name, result->producers, result->consumers, result->capacity,
+            result->items, impl->batched ? result->batch : 1, result->seconds, rate,
+            result->p50_ns, result->p99_ns, result->p999_ns, result->switches,
+            result->spun, result->parked, result->ok);
+    }
+    fflush(stdout);
+}
+
+
+/**
+ * Parse a comma separated list of positive numbers
+ * @return int - The number of values, 0 if any is not positive
+ */
+static int parse_list(const char *text, long *values) {
+    int count = 0;
+    char *end;
+
+    while (*text && count < MAX_VALUES) {
+        values[count] = strtol(text, &end, 10);
+        if (end == text || values[count] <= 0) {
+            return 0;
+        }
+        ++count;
+        text = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+
+static int selected(const char *names, const char *name) {
+    size_t length = strlen(name);
+
+    for (const char *at = names; (at = strstr(at, name)) != NULL; at += length) {
+        if ((at == names || at[-1] == ',') && (at[length] == ',' || at[length] == '\0')) {
+            return 1;
+        }
+    }
     return 0;
 }
+
+
+void usage(void) {
+    fprintf(stderr, "usage: ./queue_test [-f csv|json] [-i impls] [-p producers] [-c consumers] "
+        "[-s capacities] [-n items] [-b batch] [-x]\n");
+    exit(1);
+}
+
+
+int main(int argc, char **argv) {
+    const char *format = "csv", *names = NULL;
+    long producers[MAX_VALUES] = { 1, 4, 16 }, consumers[MAX_VALUES] = { 1, 4, 16 };
+    long capacities[MAX_VALUES] = { 16, 1024 }, sizes[MAX_VALUES] = { 100000 };
+    int num_producers = 3, num_consumers = 3, num_capacities = 2, num_sizes = 1;
+    long batch = 16;
+    int checks = 1, failed = 0, opt;
+
+    while ((opt = getopt(argc, argv, "f:i:p:c:s:n:b:x")) != -1) {
+        switch (opt) {
+            case 'f':
+                format = optarg;
+                if (strcmp(format, "csv") != 0 && strcmp(format, "json") != 0) {
+                    usage();
+                }
+                break;
+            case 'i':
+                names = optarg;
+                break;
+            case 'p':
+                num_producers = parse_list(optarg, producers);
+                break;
+            case 'c':
+                num_consumers = parse_list(optarg, consumers);
+                break;
+            case 's':
+                num_capacities = parse_list(optarg, capacities);
+                break;
+            case 'n':
+                num_sizes = parse_list(optarg, sizes);
+                break;
+            case 'b':
+                batch = atol(optarg);
+                break;
+            case 'x':
+                checks = 0;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (!num_producers || !num_consumers || !num_capacities || !num_sizes || batch < 1 || batch > MAX_BATCH) {
+        usage();
+    }
+    for (int i = 0; i < MAX_VALUES; ++i) {
+        if (producers[i] > MAX_THREADS || consumers[i] > MAX_THREADS) {
+            usage();
+        }
+    }
+
+    if (checks) {
+        failed |= check_timeouts() != 0;
+        failed |= check_eventfd() != 0;
+        failed |= check_priority() != 0;
+        failed |= check_deque() != 0;
+    }
+
+    int first = 1;
+    if (strcmp(format, "json") == 0) {
+        printf("[\n");
+    }
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); ++i) {
+        const Impl *impl = &impls[i];
+        if (names && !selected(names, impl->name)) {
+            continue;
+        }
+        for (int s = 0; s < num_sizes; ++s)
+        for (int q = 0; q < num_capacities; ++q)
+        for (int p = 0; p < num_producers; ++p)
+        for (int c = 0; c < num_consumers; ++c) {
+            if ((impl->max_producers && producers[p] > impl->max_producers)
+                || (impl->max_consumers && consumers[c] > impl->max_consumers)) {
+                continue;
+            }
+            Result result = { producers[p], consumers[c], capacities[q], sizes[s], batch };
+            bench(impl, &result);
+            print_result(format, impl, &result, first);
+            failed = failed || !result.ok;
+            first = 0;
+        }
+    }
+    if (strcmp(format, "json") == 0) {
+        printf("\n]\n");
+    }
+
+    return failed;
+}
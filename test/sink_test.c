@@ -0,0 +1,193 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sink.h"
+#include "pool.h"
+
+#define SEGMENT_SIZE (1 << 20)
+#define DEFAULT_MB 256
+
+
+/**
+ * Count the pages of a file resident in the page cache
+ * @param path - The file to check
+ * @param size - The size of the file in bytes
+ * @return long - The number of resident pages, -1 on failure
+ */
+long resident_pages(const char *path, long size) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    long pages = (size + page_size - 1) / page_size, resident = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    unsigned char *vec = malloc(pages);
+    if (mincore(map, size, vec) == 0) {
+        for (long i = 0; i < pages; ++i) {
+            resident += vec[i] & 1;
+        }
+    }
+    else {
+        resident = -1;
+    }
+
+    free(vec);
+    munmap(map, size);
+    return resident;
+}
+
+
+/**
+ * Fill a segment with what the file holds at an offset: a byte pattern
+ * with the offset stamped over its start, so a segment written to the
+ * wrong place or only in part does not match
+ * @param segment - The segment, SEGMENT_SIZE bytes
+ * @param offset - The offset of the segment in the file
+ * @param pattern - Whether to lay down the byte pattern too or only stamp
+ */
+void fill_segment(char *segment, long offset, int pattern) {
+    if (pattern) {
+        for (int i = 0; i < SEGMENT_SIZE; ++i) {
+            segment[i] = i % 251;
+        }
+    }
+    memcpy(segment, &offset, sizeof offset);
+}
+
+
+/**
+ * Check the size of a written file and the contents of its middle and
+ * last segments
+ * @param path - The written file
+ * @param size - The size it should have
+ * @return int - 0 if it matches, -1 otherwise
+ */
+int verify(const char *path, long size) {
+    struct stat st;
+
+    if (stat(path, &st) != 0 || st.st_size != size) {
+        fprintf(stderr, "%s: wrong size\n", path);
+        return -1;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    char *expected = malloc(SEGMENT_SIZE), *actual = malloc(SEGMENT_SIZE);
+    long offsets[2] = { size / 2 / SEGMENT_SIZE * SEGMENT_SIZE, (size - 1) / SEGMENT_SIZE * SEGMENT_SIZE };
+    int rc = 0;
+
+    fill_segment(expected, 0, 1);
+    for (int i = 0; i < 2 && rc == 0; ++i) {
+        long length = size - offsets[i] < SEGMENT_SIZE ? size - offsets[i] : SEGMENT_SIZE;
+        fill_segment(expected, offsets[i], 0);
+        if (pread(fd, actual, length, offsets[i]) != length || memcmp(actual, expected, length) != 0) {
+            fprintf(stderr, "%s: wrong contents at offset %ld\n", path, offsets[i]);
+            rc = -1;
+        }
+    }
+
+    free(expected);
+    free(actual);
+    close(fd);
+    return rc;
+}
+
+
+/**
+ * Write size bytes through a sink in pooled segments, like the downloader
+ * does, with an unaligned tail at the end, then check what was written
+ * @param path - The file to write
+ * @param size - The size of the file in bytes
+ * @param mode - The sink mode
+ * @param pool - The pool of aligned segments
+ * @param release - Whether to release each segment once the next is written
+ * @return int - 0 if the file came out right, -1 otherwise
+ */
+int run(const char *path, long size, int mode, Pool *pool, int release) {
+    struct timespec start, end;
+    char *segment = pool_get(pool);
+    fill_segment(segment, 0, 1);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    Sink *sink = sink_open(path, size, mode);
+    if (sink == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    for (long offset = 0; offset < size; offset += SEGMENT_SIZE) {
+        long length = size - offset < SEGMENT_SIZE ? size - offset : SEGMENT_SIZE;
+        fill_segment(segment, offset, 0);
+        if (sink_write(sink, offset, segment, length) != 0) {
+            exit(EXIT_FAILURE);
+        }
+        if (release && offset > 0) {
+            sink_release(sink, offset - SEGMENT_SIZE, SEGMENT_SIZE);
+        }
+    }
+    if (release) {
+        sink_release(sink, size - (size - 1) % SEGMENT_SIZE - 1, (size - 1) % SEGMENT_SIZE + 1);
+    }
+    if (sink_close(sink) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pool_put(pool, segment);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    printf("%-13s %8.1f MB/s  %8ld of %ld pages left in the page cache\n",
+        mode == SINK_DIRECT ? "direct" : mode == SINK_MMAP ? "mmap" : release ? "write-behind" : "buffered",
+        size / seconds / (1 << 20),
+        resident_pages(path, size), (size + page_size - 1) / page_size);
+
+    return verify(path, size);
+}
+
+
+int main(int argc, char **argv) {
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: ./sink_test dir [megabytes]\n");
+        exit(1);
+    }
+
+    long megabytes = argc > 2 ? atol(argv[2]) : DEFAULT_MB;
+    long size = megabytes * (1 << 20) + 123;    //An unaligned tail on purpose
+
+    char path[1024];
+    snprintf(path, sizeof path, "%s/sink_test.bin", argv[1]);
+
+    Pool *pool = pool_alloc(SEGMENT_SIZE, SINK_ALIGN);
+
+    int failed = 0;
+    failed |= run(path, size, SINK_MMAP, pool, 0);
+    failed |= run(path, size, SINK_BUFFERED, pool, 0);
+    failed |= run(path, size, SINK_BUFFERED, pool, 1);
+    failed |= run(path, size, SINK_DIRECT, pool, 0);
+
+    unlink(path);
+    pool_free(pool);
+    return failed ? EXIT_FAILURE : 0;
+}